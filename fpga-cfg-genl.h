@@ -0,0 +1,47 @@
+/*
+ * Userspace interface of the fpga-cfg generic netlink family.
+ *
+ * Copyright (C) 2017 DENX Software Engineering
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+#ifndef _FPGA_CFG_GENL_H
+#define _FPGA_CFG_GENL_H
+
+#define FPGA_CFG_GENL_NAME		"fpga_cfg"
+#define FPGA_CFG_GENL_VERSION		1
+#define FPGA_CFG_GENL_MCGRP_EVENTS	"events"
+
+/*
+ * Events multicast to the "events" group. Every stage of a load is
+ * reported with FPGA_CFG_CMD_STAGE_END, the load itself is reported
+ * after its stages with FPGA_CFG_CMD_LOAD_END and the same sequence
+ * number. Events are sent in the initial network namespace only.
+ */
+enum fpga_cfg_genl_cmd {
+	FPGA_CFG_CMD_UNSPEC,
+	FPGA_CFG_CMD_STAGE_END,
+	FPGA_CFG_CMD_LOAD_END,
+	__FPGA_CFG_CMD_MAX,
+};
+#define FPGA_CFG_CMD_MAX	(__FPGA_CFG_CMD_MAX - 1)
+
+enum fpga_cfg_genl_attr {
+	FPGA_CFG_ATTR_UNSPEC,
+	FPGA_CFG_ATTR_PAD,
+	FPGA_CFG_ATTR_INSTANCE,		/* string, e.g. "fpp_single.0" */
+	FPGA_CFG_ATTR_SEQ,		/* u64, load sequence number */
+	FPGA_CFG_ATTR_STAGE,		/* string, stage as in 'stats' */
+	FPGA_CFG_ATTR_RESULT,		/* s32, 0 or negative errno */
+	FPGA_CFG_ATTR_DURATION_NS,	/* u64 */
+	FPGA_CFG_ATTR_BYTES,		/* u64, image size, stage only */
+	FPGA_CFG_ATTR_IMAGE,		/* string, FPP/SPI/PR image path */
+	FPGA_CFG_ATTR_CVP_IMAGE,	/* string, CvP image path */
+	FPGA_CFG_ATTR_PR_REGION,	/* u32, PR loads only */
+	__FPGA_CFG_ATTR_MAX,
+};
+#define FPGA_CFG_ATTR_MAX	(__FPGA_CFG_ATTR_MAX - 1)
+
+#endif /* _FPGA_CFG_GENL_H */
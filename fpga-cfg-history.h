@@ -0,0 +1,88 @@
+/*
+ * Byte ring of the fpga-cfg configuration history.
+ *
+ * Copyright (C) 2017 DENX Software Engineering
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * Included by fpga-cfg.c and by tools/history-bench.c, which builds it
+ * in user space against the headers in tools/include.
+ */
+#ifndef _FPGA_CFG_HISTORY_H
+#define _FPGA_CFG_HISTORY_H
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+/*
+ * Entries are appended to buf (size bytes), the oldest one starts at
+ * start. lens holds the length of each entry, also as ring of
+ * max_entries, first is the oldest one. The buffers are allocated by
+ * the user, appending and seeking never allocate.
+ */
+struct fpga_cfg_ring {
+	char *buf;
+	size_t size;
+	size_t start;
+	size_t bytes;
+	u16 *lens;
+	size_t first;
+	size_t max_entries;
+	size_t entries;
+	/* bytes ever appended, offset of history_follow reads */
+	u64 total;
+};
+
+static inline void fpga_cfg_ring_reset(struct fpga_cfg_ring *r)
+{
+	r->start = 0;
+	r->bytes = 0;
+	r->first = 0;
+	r->entries = 0;
+}
+
+/* Append an entry of at most size bytes, dropping the oldest ones */
+static inline void fpga_cfg_ring_add(struct fpga_cfg_ring *r,
+				     const char *entry, size_t len)
+{
+	size_t pos, n;
+
+	while (r->entries &&
+	       (r->entries >= r->max_entries || r->bytes + len > r->size)) {
+		n = r->lens[r->first];
+		r->start = (r->start + n) % r->size;
+		r->bytes -= n;
+		r->first = (r->first + 1) % r->max_entries;
+		r->entries--;
+	}
+
+	pos = (r->start + r->bytes) % r->size;
+	n = min(len, r->size - pos);
+	memcpy(r->buf + pos, entry, n);
+	memcpy(r->buf, entry + n, len - n);
+
+	r->lens[(r->first + r->entries) % r->max_entries] = len;
+	r->entries++;
+	r->bytes += len;
+	r->total += len;
+}
+
+/*
+ * Contiguous part of the bytes rel bytes after the oldest entry, at most
+ * count bytes. The ring wraps at most once, so copying count bytes takes
+ * at most two parts.
+ */
+static inline const char *fpga_cfg_ring_seg(const struct fpga_cfg_ring *r,
+					    size_t rel, size_t count,
+					    size_t *n)
+{
+	size_t off = (r->start + rel) % r->size;
+
+	*n = min(count, r->size - off);
+	return r->buf + off;
+}
+
+#endif /* _FPGA_CFG_HISTORY_H */
@@ -0,0 +1,104 @@
+/*
+ * Userspace interface of the fpga-cfg device /dev/fpga_cfg/<name>.
+ *
+ * Copyright (C) 2017 DENX Software Engineering
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+#ifndef _FPGA_CFG_IOCTL_H
+#define _FPGA_CFG_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Configuration step the uploaded image is used for */
+enum fpga_cfg_upload_step {
+	FPGA_CFG_UPLOAD_FPP,
+	FPGA_CFG_UPLOAD_SPI,
+	FPGA_CFG_UPLOAD_CVP,
+	FPGA_CFG_UPLOAD_PR,
+};
+
+/**
+ * struct fpga_cfg_upload - load the image written to the device
+ * @step: enum fpga_cfg_upload_step
+ * @desc_len: length of the configuration description, 0 if none
+ * @desc: user pointer to a configuration description with further
+ *	  options (bus number, driver, images of other steps), in the
+ *	  same format as written to the 'load' file
+ */
+struct fpga_cfg_upload {
+	__u32 step;
+	__u32 desc_len;
+	__u64 desc;
+};
+
+/*
+ * Binary configuration description for FPGA_CFG_IOC_LOAD_DESC, a list
+ * of type-length-value entries. Every entry starts at a 4 byte aligned
+ * offset, string values are not NUL terminated. The entries correspond
+ * to the keys of the text description.
+ */
+enum fpga_cfg_tlv_type {
+	FPGA_CFG_TLV_FPGA_TYPE = 1,	/* string, fpga-type */
+	FPGA_CFG_TLV_BDF,		/* struct fpga_cfg_tlv_bdf */
+	FPGA_CFG_TLV_USB_DEV_ID,	/* string, fpp-usb-dev-id */
+	FPGA_CFG_TLV_SPI_LSB_FIRST,	/* __u32 */
+	FPGA_CFG_TLV_FPP_IMAGE,		/* string, path under /lib/firmware/ */
+	FPGA_CFG_TLV_SPI_IMAGE,		/* string, path under /lib/firmware/ */
+	FPGA_CFG_TLV_CVP_IMAGE,		/* string, path under /lib/firmware/ */
+	FPGA_CFG_TLV_PR_IMAGE,		/* string, path under /lib/firmware/ */
+	FPGA_CFG_TLV_FPP_META,		/* string, path */
+	FPGA_CFG_TLV_SPI_META,		/* string, path */
+	FPGA_CFG_TLV_CVP_META,		/* string, path */
+	FPGA_CFG_TLV_PR_META,		/* string, path */
+	FPGA_CFG_TLV_MFD_DRIVER,	/* string */
+	FPGA_CFG_TLV_MFD_DRIVER_PARAM,	/* string */
+	FPGA_CFG_TLV_IMAGE_FD,		/* struct fpga_cfg_tlv_fd */
+	FPGA_CFG_TLV_PR_REGION,		/* string, part-reconf-region */
+	FPGA_CFG_TLV_PR_PRIORITY,	/* string, part-reconf-priority */
+};
+
+struct fpga_cfg_tlv {
+	__u16 type;
+	__u16 len;	/* length of value */
+	__u8 value[];
+};
+
+struct fpga_cfg_tlv_bdf {
+	__u8 bus;
+	__u8 dev;
+	__u8 func;
+	__u8 pad;
+};
+
+/* Image read from an open file instead of a path, at most one per load */
+struct fpga_cfg_tlv_fd {
+	__u32 step;	/* enum fpga_cfg_upload_step */
+	__s32 fd;
+};
+
+/**
+ * struct fpga_cfg_desc - binary configuration description
+ * @len: length of the entries
+ * @flags: must be 0
+ * @data: user pointer to the struct fpga_cfg_tlv entries
+ */
+struct fpga_cfg_desc {
+	__u32 len;
+	__u32 flags;
+	__u64 data;
+};
+
+#define FPGA_CFG_IOC_MAGIC	0xfc
+
+/* Drop the data written so far */
+#define FPGA_CFG_IOC_RESET	_IO(FPGA_CFG_IOC_MAGIC, 0)
+/* Run the configuration with the written image, then drop it */
+#define FPGA_CFG_IOC_LOAD	_IOW(FPGA_CFG_IOC_MAGIC, 1, struct fpga_cfg_upload)
+/* Run the configuration of a binary description */
+#define FPGA_CFG_IOC_LOAD_DESC	_IOW(FPGA_CFG_IOC_MAGIC, 2, struct fpga_cfg_desc)
+
+#endif /* _FPGA_CFG_IOCTL_H */
@@ -0,0 +1,161 @@
+/*
+ * Tokenizer and key lookup of the fpga-cfg configuration description.
+ *
+ * Copyright (C) 2017 DENX Software Engineering
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * Included by fpga-cfg.c and by tools/parse-bench.c, which builds it in
+ * user space against the headers in tools/include.
+ */
+#ifndef _FPGA_CFG_PARSE_H
+#define _FPGA_CFG_PARSE_H
+
+#include <linux/ctype.h>
+#include <linux/limits.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+/* Configuration steps, FPGA manager types and description keys */
+enum fpga_cfg_mgr_type {
+	NOP_MGR,
+	FPP_RING_MGR,
+	SPI_RING_MGR,
+	CVP_MGR,
+	PR_MGR,
+	FPP_META,
+	SPI_META,
+	CVP_META,
+	PR_META,
+	SPI_MGR,
+	CFG_BUS_NR,
+	CFG_USB_ID,
+	CFG_TYPE,
+	CFG_BS_LSB,
+	FPGA_DRV,
+	FPGA_DRV_ARGS,
+	PR_REGION,
+	PR_PRIO,
+};
+
+#define VAL_SZ	(PATH_MAX + NAME_MAX + 3)
+
+/* Line 'key = "value";' of a description split into key and value */
+struct fpga_cfg_tok {
+	const char *key;
+	size_t key_len;
+	const char *val;
+	size_t val_len;
+};
+
+#define KEY_MATCH(str, type)					\
+	do {							\
+		if (len == sizeof(str) - 1 &&			\
+		    !memcmp(key, str, sizeof(str) - 1))		\
+			return type;				\
+	} while (0)
+
+/* Key lookup by length, NOP_MGR for unknown keys */
+static enum fpga_cfg_mgr_type fpga_cfg_key_lookup(const char *key,
+						  size_t len)
+{
+	switch (len) {
+	case 9:
+		KEY_MATCH("fpp-image", FPP_RING_MGR);
+		KEY_MATCH("spi-image", SPI_RING_MGR);
+		KEY_MATCH("cvp-image", CVP_MGR);
+		KEY_MATCH("fpga-type", CFG_TYPE);
+		break;
+	case 10:
+		KEY_MATCH("mfd-driver", FPGA_DRV);
+		break;
+	case 13:
+		KEY_MATCH("spi-lsb-first", CFG_BS_LSB);
+		break;
+	case 14:
+		KEY_MATCH("fpp-image-meta", FPP_META);
+		KEY_MATCH("spi-image-meta", SPI_META);
+		KEY_MATCH("cvp-image-meta", CVP_META);
+		KEY_MATCH("fpp-usb-dev-id", CFG_USB_ID);
+		break;
+	case 16:
+		KEY_MATCH("fpga-pcie-bus-nr", CFG_BUS_NR);
+		KEY_MATCH("mfd-driver-param", FPGA_DRV_ARGS);
+		break;
+	case 17:
+		KEY_MATCH("part-reconf-image", PR_MGR);
+		break;
+	case 18:
+		KEY_MATCH("part-reconf-region", PR_REGION);
+		break;
+	case 20:
+		KEY_MATCH("part-reconf-priority", PR_PRIO);
+		break;
+	case 22:
+		KEY_MATCH("part-reconf-image-meta", PR_META);
+		break;
+	}
+	return NOP_MGR;
+}
+
+#undef KEY_MATCH
+
+/*
+ * Split the line [p, eol) into key and value. The value is everything
+ * between the first and the last '"', which must be followed by ';'.
+ * Returns NULL or the position of the error described by msg.
+ */
+static const char *fpga_cfg_parse_line(const char *p, const char *eol,
+				       struct fpga_cfg_tok *tok,
+				       const char **msg)
+{
+	const char *q;
+
+	while (p < eol && isspace(*p))
+		p++;
+	tok->key = p;
+	while (p < eol && !isspace(*p) && *p != '=')
+		p++;
+	tok->key_len = p - tok->key;
+	if (!tok->key_len) {
+		*msg = "key expected";
+		return p;
+	}
+
+	while (p < eol && isspace(*p))
+		p++;
+	if (p == eol || *p != '=') {
+		*msg = "'=' expected";
+		return p;
+	}
+	p++;
+
+	while (p < eol && isspace(*p))
+		p++;
+	if (p == eol || *p != '"') {
+		*msg = "'\"' expected";
+		return p;
+	}
+	tok->val = ++p;
+
+	for (q = eol - 1; q >= tok->val && *q != '"'; q--)
+		;
+	if (q < tok->val) {
+		*msg = "closing '\"' expected";
+		return eol;
+	}
+	if (q + 1 == eol || q[1] != ';') {
+		*msg = "';' expected";
+		return q + 1;
+	}
+	tok->val_len = q - tok->val;
+	if (tok->val_len > VAL_SZ) {
+		*msg = "value too long";
+		return tok->val;
+	}
+	return NULL;
+}
+
+#endif /* _FPGA_CFG_PARSE_H */
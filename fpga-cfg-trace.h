@@ -0,0 +1,180 @@
+/*
+ * Tracepoints of the fpga-cfg driver.
+ *
+ * Copyright (C) 2017 DENX Software Engineering
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fpga_cfg
+
+#if !defined(_FPGA_CFG_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FPGA_CFG_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * name is the interface directory name, e.g. "fpp_single.0". seq is the
+ * load sequence number of the instance, 0 before a load was started.
+ */
+TRACE_EVENT(fpga_cfg_load_start,
+
+	TP_PROTO(const char *name, u64 seq, int op, unsigned int region),
+
+	TP_ARGS(name, seq, op, region),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(u64, seq)
+		__field(int, op)
+		__field(unsigned int, region)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->seq = seq;
+		__entry->op = op;
+		__entry->region = region;
+	),
+
+	TP_printk("%s seq=%llu op=%d region=%u", __get_str(name),
+		  __entry->seq, __entry->op, __entry->region)
+);
+
+TRACE_EVENT(fpga_cfg_load_end,
+
+	TP_PROTO(const char *name, u64 seq, int ret, u64 duration_ns),
+
+	TP_ARGS(name, seq, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(u64, seq)
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->seq = seq;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("%s seq=%llu ret=%d duration_ns=%llu", __get_str(name),
+		  __entry->seq, __entry->ret, __entry->duration_ns)
+);
+
+DECLARE_EVENT_CLASS(fpga_cfg_stage,
+
+	TP_PROTO(const char *name, u64 seq, const char *stage, size_t bytes,
+		 int ret),
+
+	TP_ARGS(name, seq, stage, bytes, ret),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(u64, seq)
+		__string(stage, stage)
+		__field(size_t, bytes)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->seq = seq;
+		__assign_str(stage, stage);
+		__entry->bytes = bytes;
+		__entry->ret = ret;
+	),
+
+	TP_printk("%s seq=%llu stage=%s bytes=%zu ret=%d", __get_str(name),
+		  __entry->seq, __get_str(stage), __entry->bytes, __entry->ret)
+);
+
+DEFINE_EVENT(fpga_cfg_stage, fpga_cfg_stage_start,
+
+	TP_PROTO(const char *name, u64 seq, const char *stage, size_t bytes,
+		 int ret),
+
+	TP_ARGS(name, seq, stage, bytes, ret)
+);
+
+DEFINE_EVENT(fpga_cfg_stage, fpga_cfg_stage_end,
+
+	TP_PROTO(const char *name, u64 seq, const char *stage, size_t bytes,
+		 int ret),
+
+	TP_ARGS(name, seq, stage, bytes, ret)
+);
+
+/* Bus notification for the PCIe device an instance waits for */
+TRACE_EVENT(fpga_cfg_pci_event,
+
+	TP_PROTO(const char *name, const char *dev, unsigned long action,
+		 const char *driver),
+
+	TP_ARGS(name, dev, action, driver),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__string(dev, dev)
+		__field(unsigned long, action)
+		__string(driver, driver)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__assign_str(dev, dev);
+		__entry->action = action;
+		__assign_str(driver, driver);
+	),
+
+	TP_printk("%s dev=%s action=%s driver=%s", __get_str(name),
+		  __get_str(dev),
+		  __print_symbolic(__entry->action,
+				   { BUS_NOTIFY_BIND_DRIVER, "bind" },
+				   { BUS_NOTIFY_BOUND_DRIVER, "bound" },
+				   { BUS_NOTIFY_UNBIND_DRIVER, "unbind" },
+				   { BUS_NOTIFY_UNBOUND_DRIVER, "unbound" }),
+		  __get_str(driver))
+);
+
+TRACE_EVENT(fpga_cfg_history_add,
+
+	TP_PROTO(const char *name, size_t seq, size_t len, u64 total,
+		 size_t entries),
+
+	TP_ARGS(name, seq, len, total, entries),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(size_t, seq)
+		__field(size_t, len)
+		__field(u64, total)
+		__field(size_t, entries)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->seq = seq;
+		__entry->len = len;
+		__entry->total = total;
+		__entry->entries = entries;
+	),
+
+	TP_printk("%s seq=%zu len=%zu total=%llu entries=%zu",
+		  __get_str(name), __entry->seq, __entry->len, __entry->total,
+		  __entry->entries)
+);
+
+#endif /* _FPGA_CFG_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fpga-cfg-trace
+#include <trace/define_trace.h>
@@ -17,6 +17,7 @@
 #define DEBUG
 #endif
 
+#include <crypto/hash.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
@@ -26,10 +27,32 @@
 #include <linux/version.h>
 #include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
 #include <linux/fpga/fpga-mgr.h>
 #include <linux/uaccess.h>
 #include <linux/fsnotify.h>
 #include <linux/idr.h>
+#include <linux/completion.h>
+#include <linux/miscdevice.h>
+#include <linux/crc32.h>
+#include <linux/ctype.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/kref.h>
+#include <linux/namei.h>
+#include <linux/sizes.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/xz.h>
+#include <linux/zlib.h>
+#include <linux/zstd.h>
+#include <asm/unaligned.h>
+#include <net/genetlink.h>
+
+#include "fpga-cfg-genl.h"
+#include "fpga-cfg-history.h"
+#include "fpga-cfg-ioctl.h"
+#include "fpga-cfg-parse.h"
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(4, 10, 0)
 #include <linux/sched.h>
@@ -37,6 +60,9 @@
 #include <linux/sched/clock.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "fpga-cfg-trace.h"
+
 #define FPGA_DRV_STRING		"fpga_cfg"
 #define FPP_RING_MGR_NAME	"ftdi-fpp-fpga-mgr"
 
@@ -51,15 +77,69 @@
 #define FPGA_CFG_HISTORY_ENTRIES_MIN	500
 #define FPGA_CFG_HISTORY_ENTRIES_MAX	10000
 #define FPGA_CFG_HISTORY_ENTRIES_DFLT	5000
+/* history ring bytes per entry, older entries are dropped if exceeded */
+#define FPGA_CFG_HISTORY_ENTRY_BYTES	256
+#define FPGA_CFG_HISTORY_HDR_SZ		128
 
 static unsigned int fpgacfg_hist_len = FPGA_CFG_HISTORY_ENTRIES_DFLT;
 module_param(fpgacfg_hist_len, uint, 0);
 MODULE_PARM_DESC(fpgacfg_hist_len,
 		 "Max number of entries for FPGA config operations history");
 
+static unsigned long fpgacfg_cache_max_bytes = SZ_64M;
+module_param(fpgacfg_cache_max_bytes, ulong, 0644);
+MODULE_PARM_DESC(fpgacfg_cache_max_bytes,
+		 "Max size of the in-memory bitstream cache (0 - disabled)");
+
+static bool fpgacfg_prefetch = true;
+module_param(fpgacfg_prefetch, bool, 0644);
+MODULE_PARM_DESC(fpgacfg_prefetch,
+		 "Read CvP/PR images while the ring image is loaded (default 1)");
+
+static unsigned long fpgacfg_stream_min_bytes = SZ_8M;
+module_param(fpgacfg_stream_min_bytes, ulong, 0644);
+MODULE_PARM_DESC(fpgacfg_stream_min_bytes,
+		 "Min size of uncompressed images read into page chunks instead of the cache (0 - never)");
+
+static unsigned int fpgacfg_bus_jobs = 4;
+module_param(fpgacfg_bus_jobs, uint, 0644);
+MODULE_PARM_DESC(fpgacfg_bus_jobs,
+		 "Max concurrent FPP/SPI image writes per USB bus or SPI controller (0 - unlimited)");
+
+static unsigned int fpgacfg_pr_jobs = 2;
+module_param(fpgacfg_pr_jobs, uint, 0644);
+MODULE_PARM_DESC(fpgacfg_pr_jobs,
+		 "Max concurrent async PR loads per instance (1 - 4, default 2)");
+
 static DEFINE_MUTEX(mgr_list_lock);
 static struct list_head mgr_devs = LIST_HEAD_INIT(mgr_devs);
-static struct list_head pci_dev_wait_list = LIST_HEAD_INIT(pci_dev_wait_list);
+
+/* bus groups of the probed instances, see struct fpga_cfg_bus_group */
+static DEFINE_MUTEX(bus_groups_lock);
+static LIST_HEAD(bus_groups);
+
+/*
+ * Instances waiting for a driver bind/unbind of their PCIe FPGA device,
+ * hashed by (domain, bus, devfn). The bus notifier runs for every PCI
+ * device of the system, unrelated devices only cost a bucket lookup.
+ */
+#define FPGA_CFG_WAIT_BITS	4
+#define FPGA_CFG_PCI_KEY(domain, bus, devfn) \
+	(((u32)(domain) << 16) | ((u32)(bus) << 8) | (devfn))
+/* fpga-pcie-bus-nr has no domain, the devices are looked up in domain 0 */
+#define FPGA_CFG_PCI_DOMAIN	0
+
+static DEFINE_MUTEX(pci_wait_lock);
+static DEFINE_HASHTABLE(pci_dev_waiters, FPGA_CFG_WAIT_BITS);
+
+/*
+ * PR regions holding PR manager and PCI device handles, hashed like
+ * pci_dev_waiters. Entries change under pr_cache_lock and pci_wait_lock,
+ * so the bus notifier checks for handles of an unbinding device under
+ * pci_wait_lock only and takes pr_cache_lock just for cached devices.
+ */
+static DEFINE_MUTEX(pr_cache_lock);
+static DEFINE_HASHTABLE(pr_cache, FPGA_CFG_WAIT_BITS);
 static struct dentry *dbgfs_root;
 
 static struct class *fpga_mgr_class;
@@ -72,25 +152,6 @@ struct fpga_cfg_device {
 	struct platform_device *pdev;
 };
 
-enum fpga_cfg_mgr_type {
-	NOP_MGR,
-	FPP_RING_MGR,
-	SPI_RING_MGR,
-	CVP_MGR,
-	PR_MGR,
-	FPP_META,
-	SPI_META,
-	CVP_META,
-	PR_META,
-	SPI_MGR,
-	CFG_BUS_NR,
-	CFG_USB_ID,
-	CFG_TYPE,
-	CFG_BS_LSB,
-	FPGA_DRV,
-	FPGA_DRV_ARGS,
-};
-
 struct fpga_cfg_mgr {
 	const char *mgr_name;
 	enum fpga_cfg_mgr_type mgr_type;
@@ -103,6 +164,25 @@ struct fpga_cfg_mgr fpga_cfg_mgr_tbl[] = {
 	{ },
 };
 
+#define FPGA_CFG_DIGEST_SIZE	32	/* sha256 */
+
+/* Images written through a manager, for the throughput in 'stats' */
+struct fpga_cfg_tput {
+	spinlock_t lock;
+	u64 loads;
+	u64 bytes;
+	u64 ns;
+	u64 last_bps;
+};
+
+/* Copy of the fpga_cfg_tput counters taken under its lock */
+struct fpga_cfg_tput_snap {
+	u64 loads;
+	u64 bytes;
+	u64 ns;
+	u64 last_bps;
+};
+
 struct cfg_desc {
 	struct fpga_manager *mgr;
 	struct device *mgr_dev;
@@ -112,15 +192,289 @@ struct cfg_desc {
 	char firmware_abs[PATH_MAX + NAME_MAX];
 	char metadata_abs[PATH_MAX + NAME_MAX];
 	char log_tmp[PATH_MAX + NAME_MAX + 64];
+	/* digest of the image loaded last, for load_if_changed */
+	u8 digest[FPGA_CFG_DIGEST_SIZE];
+	bool digest_valid;
+	/* image read ahead while the ring image is loaded */
+	struct work_struct prefetch_work;
+	struct device *prefetch_dev;
+	struct fpga_cfg_img *prefetch_img;
+	bool prefetch_queued;
+	/* image from the upload device, set for one load */
+	struct fpga_cfg_pages *upload;
+	/* sequence number of the load using this desc, for tracing */
+	u64 load_seq;
+	struct fpga_cfg_tput tput;
+};
+
+/*
+ * Image names of one configuration step as given in the description.
+ * Copied to the matching struct cfg_desc when the load is executed.
+ */
+struct cfg_image {
+	char firmware[NAME_MAX];
+	char firmware_abs[PATH_MAX + NAME_MAX];
+	char metadata_abs[PATH_MAX + NAME_MAX];
+};
+
+/*
+ * Parsed configuration description. The parser fills this request
+ * instead of the instance, so that a queued (async) load does not
+ * clobber the state of a currently running load.
+ */
+struct fpga_cfg_req {
+	u32 keys;	/* BIT(enum fpga_cfg_mgr_type) of parsed keys */
+	enum fpga_cfg_mgr_type cfg_op1;
+	enum fpga_cfg_mgr_type cfg_op2;
+	int bus;
+	int dev;
+	int func;
+	int bs_lsb_first;
+	char bdf[16];
+	char type[16];
+	char fpga_drv[48];
+	char fpga_drv_args[2048];
+	struct cfg_image fpp;
+	struct cfg_image spi;
+	struct cfg_image cvp;
+	struct cfg_image pr;
+	/* image written to the upload device, replaces the file */
+	enum fpga_cfg_mgr_type upload_type;
+	struct fpga_cfg_pages *upload;
+	unsigned int pr_region;
+	unsigned int pr_prio;
+};
+
+#define FPGA_CFG_JOB_RESULTS	32
+
+enum fpga_cfg_job_state {
+	FPGA_CFG_JOB_QUEUED,
+	FPGA_CFG_JOB_RUNNING,
+	FPGA_CFG_JOB_DONE,
+	FPGA_CFG_JOB_FAILED,
+	FPGA_CFG_JOB_SUPERSEDED,
+};
+
+struct fpga_cfg_job_result {
+	size_t id;
+	enum fpga_cfg_job_state state;
+	int err;
+	pid_t tgid;	/* process that queued the job */
+};
+
+#define FPGA_CFG_LAT_BUCKETS	12
+
+/* Latency distribution, bucket N counts values below 2^N ms */
+struct fpga_cfg_lat_hist {
+	spinlock_t lock;
+	u64 count;
+	u64 min_ns;
+	u64 max_ns;
+	u64 sum_ns;
+	u64 last_ns;
+	u64 buckets[FPGA_CFG_LAT_BUCKETS];
+};
+
+/* Copy of the fpga_cfg_lat_hist counters taken under its lock */
+struct fpga_cfg_lat_snap {
+	u64 count;
+	u64 min_ns;
+	u64 max_ns;
+	u64 sum_ns;
+	u64 last_ns;
+	u64 buckets[FPGA_CFG_LAT_BUCKETS];
+};
+
+/* Load stages timed in the debugfs 'stats' file */
+enum fpga_cfg_stage {
+	FPGA_CFG_STAGE_PARSE,
+	FPGA_CFG_STAGE_FETCH,
+	FPGA_CFG_STAGE_WRITE,
+	FPGA_CFG_STAGE_UNBIND,
+	FPGA_CFG_STAGE_LINKUP,
+	FPGA_CFG_STAGE_CVP,
+	FPGA_CFG_STAGE_MODPROBE,
+	FPGA_CFG_STAGE_BIND,
+	FPGA_CFG_STAGES,
+};
+
+static const char * const fpga_cfg_stage_str[] = {
+	[FPGA_CFG_STAGE_PARSE]		= "parse",
+	[FPGA_CFG_STAGE_FETCH]		= "fetch",
+	[FPGA_CFG_STAGE_WRITE]		= "write",
+	[FPGA_CFG_STAGE_UNBIND]		= "unbind",
+	[FPGA_CFG_STAGE_LINKUP]		= "linkup",
+	[FPGA_CFG_STAGE_CVP]		= "cvp",
+	[FPGA_CFG_STAGE_MODPROBE]	= "modprobe",
+	[FPGA_CFG_STAGE_BIND]		= "bind",
+};
+
+/*
+ * Last started or finished stage of any load, shown in 'progress'.
+ * The managers write an image in one call, so the bytes of a running
+ * write are estimated from the average throughput of the manager.
+ * Pollers are notified at most every FPGA_CFG_PROGRESS_MS.
+ */
+#define FPGA_CFG_PROGRESS_MS	250
+
+struct fpga_cfg_progress {
+	spinlock_t lock;
+	u64 seq;
+	enum fpga_cfg_stage stage;
+	bool running;
+	int ret;
+	size_t bytes_done;
+	size_t bytes_total;
+	u64 start_ns;
+	u64 end_ns;
+	u64 last_bps;
+	u64 avg_bps;
+	unsigned long notified;
+};
+
+/* Copy of the fpga_cfg_progress state shown in 'progress' */
+struct fpga_cfg_progress_snap {
+	u64 seq;
+	enum fpga_cfg_stage stage;
+	bool running;
+	int ret;
+	size_t bytes_done;
+	size_t bytes_total;
+	u64 start_ns;
+	u64 end_ns;
+	u64 last_bps;
+	u64 avg_bps;
 };
 
-struct fpga_cfg_log_entry {
+#define FPGA_CFG_UNBIND_TIMEOUT_MS	500
+#define FPGA_CFG_LINKUP_TIMEOUT_MS	1000
+#define FPGA_CFG_LINKUP_POLL_MS		10
+#define FPGA_CFG_LINKUP_POLL_MAX_MS	160
+
+/*
+ * Instances on the same USB bus or SPI controller share a bus group,
+ * fpgacfg_bus_jobs limits the concurrent FPP/SPI image writes of a group.
+ */
+struct fpga_cfg_bus_group {
 	struct list_head list;
-	size_t len;
-	char entry[];
+	char name[16];
+	int users;
+	unsigned int running;
+	spinlock_t lock;
+	wait_queue_head_t wq;
 };
 
+/*
+ * Fleet manifest written to the top-level 'load' file. Each entry is
+ * loaded by the job queue of its instance. The writer and every queued
+ * job hold a reference, a writer killed while waiting leaves the fleet
+ * to its jobs.
+ */
+#define FPGA_CFG_FLEET_MAX	32
+
 struct fpga_cfg_fpga_inst;
+struct fpga_cfg_pages;
+struct fpga_cfg_upload_dev;
+
+struct fpga_cfg_fleet_entry {
+	char name[16];
+	struct fpga_cfg_fpga_inst *inst;
+	struct fpga_cfg_req *req;
+	int ret;
+	u64 duration_ns;
+};
+
+struct fpga_cfg_fleet {
+	struct kref ref;
+	atomic_t pending;
+	struct completion done;
+	int nr_entries;
+	struct fpga_cfg_fleet_entry entries[FPGA_CFG_FLEET_MAX];
+};
+
+/*
+ * Named description, parsed and checked once on registration and
+ * loaded by writing its name to the 'load' file.
+ */
+#define FPGA_CFG_PROFILES_MAX	32
+
+struct fpga_cfg_profile {
+	struct list_head list;
+	char name[32];
+	struct fpga_cfg_req *req;
+	char *desc;
+	size_t desc_len;
+	struct dentry *dentry;
+};
+
+/*
+ * Partial reconfiguration region, one per PR IP controller of the FPGA.
+ * Loads to a region are serialized by lock, loads to different regions
+ * run concurrently. Region N uses the N-th FPGA manager registered for
+ * the PCIe FPGA device. The manager (desc.mgr) and the PCI device are
+ * resolved on the first PR load after the mfd driver bound and dropped
+ * when it unbinds, protected by pr_cache_lock. The cache holds device
+ * references only, a load pins the manager's driver module while it
+ * writes, so the mfd driver can be unloaded between loads.
+ */
+#define FPGA_CFG_PR_REGIONS	4
+
+struct fpga_cfg_pr_region {
+	struct fpga_cfg_fpga_inst *inst;
+	unsigned int idx;
+	struct mutex lock;
+	struct cfg_desc desc;
+	size_t seq_num;
+	bool sysfs;
+	struct pci_dev *pdev;
+	struct hlist_node cache_node;
+	u32 cache_key;
+	unsigned long lookups;
+	unsigned long invalidations;
+	struct fpga_cfg_lat_hist lat;
+	/*
+	 * PCIe device of the last load, copied from the description (or
+	 * the instance) so the PR manager is resolved without load_lock
+	 */
+	int bus;
+	int dev;
+	int func;
+	char bdf[16];
+	/* last load of the region succeeded, for load_if_changed */
+	bool cfg_done;
+};
+
+/*
+ * PR load queued in async mode. A region has at most one pending load,
+ * a newer request for the region replaces it (latest wins). Queueing a
+ * job on job_wq seals the pending loads (gen), so PR loads are neither
+ * coalesced nor reordered across other jobs: a job waits for the PR
+ * loads queued before it, PR loads queued after a job wait for the job.
+ * Up to fpgacfg_pr_jobs loads of different regions run concurrently
+ * (under pr_sem for read), each in the work item of its region on pr_wq.
+ * When more regions have a runnable load, the one with the highest
+ * priority is started next, equal priorities in request order.
+ */
+#define FPGA_CFG_PR_PRIO_MAX	7
+
+struct fpga_cfg_pr_pending {
+	struct list_head list;
+	struct fpga_cfg_req *req;
+	size_t id;
+	unsigned int region;
+	unsigned int prio;
+	unsigned long gen;
+	bool running;
+	u64 queued_ns;
+};
+
+struct fpga_cfg_pr_worker {
+	struct work_struct work;
+	struct fpga_cfg_fpga_inst *inst;
+	unsigned int region;
+	/* load started by fpga_cfg_pr_kick() */
+	struct fpga_cfg_pr_pending *p;
+};
 
 struct fpga_cfg_attribute {
 	struct attribute attr;
@@ -137,11 +491,24 @@ struct fpga_cfg_fpga_inst {
 	struct work_struct pci_rm_work;
 	wait_queue_head_t wq_bind;
 	wait_queue_head_t wq_unbind;
-	struct list_head link;
+	struct hlist_node wait_node;
+	u32 wait_key;
 
 	struct pci_dev *pci_dev;
 	const char *driver_to_bind;
+	struct work_struct modprobe_work;
+	int modprobe_ret;
+	u64 modprobe_ns;
 	bool drv_bound;
+	unsigned int unbind_timeout_ms;
+	unsigned int linkup_timeout_ms;
+	unsigned long linkup_timeouts;
+	unsigned long linkup_rescans;
+	struct fpga_cfg_lat_hist stage_lat[FPGA_CFG_STAGES];
+	struct fpga_cfg_progress progress;
+	struct delayed_work progress_work;
+	atomic64_t load_seq;
+	u64 load_seq_cur;	/* running non-PR load */
 	int bus;
 	int dev;
 	int func;
@@ -149,6 +516,8 @@ struct fpga_cfg_fpga_inst {
 	char bdf[16];
 	char type[16];
 	char usb_dev_id[16];
+	char bus_group[16];
+	struct fpga_cfg_bus_group *bus_grp;
 	char fpga_drv[48];
 	char fpga_drv_args[2048];
 	int bs_lsb_first;
@@ -156,26 +525,60 @@ struct fpga_cfg_fpga_inst {
 	struct cfg_desc fpp;
 	struct cfg_desc spi;
 	struct cfg_desc cvp;
-	struct cfg_desc pr;
+	/* PR loads hold pr_sem for read, all other loads for write */
+	struct rw_semaphore pr_sem;
+	struct mutex pr_regions_lock;
+	struct fpga_cfg_pr_region *pr_regions[FPGA_CFG_PR_REGIONS];
+	struct mutex pr_queue_lock;
+	struct list_head pr_queue;
+	/* queued jobs not done yet, the barriers of pr_queue */
+	struct list_head pr_barriers;
+	wait_queue_head_t pr_queue_wq;
+	unsigned long pr_oldest_gen;
+	struct workqueue_struct *pr_wq;
+	struct fpga_cfg_pr_worker pr_workers[FPGA_CFG_PR_REGIONS];
+	unsigned int pr_running;
+	unsigned long pr_queue_gen;
+	unsigned int pr_queue_depth;
+	unsigned int pr_queue_max;
+	unsigned long pr_queued;
+	unsigned long pr_coalesced;
+	struct fpga_cfg_lat_hist pr_wait_lat;
 
-	struct attribute_group pr_attr_grp;
-	struct attribute *pr_attrs[3];
-	struct fpga_cfg_attribute pr_image_attr;
-	struct fpga_cfg_attribute pr_meta_attr;
-	size_t pr_seq_num;
 	size_t cfg_seq_num;
-	char pr_image_attr_name[16];
-	char pr_meta_attr_name[16];
 
 	enum fpga_cfg_mgr_type cfg_op1;
 	enum fpga_cfg_mgr_type cfg_op2;
-	bool cfg_done;
+	/* written by concurrent PR loads */
+	atomic_t cfg_done;
+	int load_if_changed;
+
+	struct mutex load_lock;
+	struct workqueue_struct *job_wq;
+	struct mutex job_lock;
+	int async;
+	/* set under pr_queue_lock by remove, no new jobs or PR loads */
+	bool removing;
+	size_t job_seq_num;
+	struct fpga_cfg_job_result job_results[FPGA_CFG_JOB_RESULTS];
+	struct dentry *dbgfs_jobs;
+	struct fpga_cfg_upload_dev *upload;
+
+	struct mutex profile_lock;
+	struct list_head profiles;
+	int nr_profiles;
+	struct dentry *dbgfs_profiles;
 
+	/*
+	 * History file: the header line followed by the entries in a byte
+	 * ring, allocated on probe
+	 */
 	bool history_header;
 	struct mutex history_lock;
-	struct list_head history_list;
-	size_t history_max_entries;
-	size_t history_entries;
+	char history_hdr[FPGA_CFG_HISTORY_HDR_SZ];
+	size_t history_hdr_len;
+	struct fpga_cfg_ring history;
+	bool history_closed;
 	unsigned hist_count;
 	unsigned hist_count_new;
 	wait_queue_head_t hist_queue;
@@ -287,6 +690,30 @@ out:
 	return -ENOMEM;
 }
 
+/* Load the mfd driver module in the background while CvP is running */
+static void fpga_cfg_modprobe_work(struct work_struct *work)
+{
+	struct fpga_cfg_fpga_inst *inst = container_of(work,
+						       struct fpga_cfg_fpga_inst,
+						       modprobe_work);
+	u64 start = local_clock();
+	int ret;
+
+	ret = fpga_cfg_modprobe(inst->fpga_drv, UMH_WAIT_PROC, false,
+				inst->fpga_drv_args);
+	inst->modprobe_ns = local_clock() - start;
+
+	/* a positive value is the wait status of a failed modprobe */
+	if (ret > 0) {
+		if (inst->debug)
+			dev_dbg(&inst->cfg->pdev->dev,
+				"modprobe '%s' exit status %d\n",
+				inst->fpga_drv, ret >> 8);
+		ret = -EIO;
+	}
+	inst->modprobe_ret = ret;
+}
+
 static int fpga_cfg_add_new_mgr(struct platform_device *pdev,
 				struct fpga_manager *mgr)
 {
@@ -419,7 +846,9 @@ static struct notifier_block fpga_mgr_notifier = {
 	.notifier_call = fpga_cfg_mgr_ncb,
 };
 
-static struct pci_dev *fpga_cfg_find_cvp_dev(struct fpga_cfg_fpga_inst *inst)
+static struct pci_dev *fpga_cfg_find_pci_dev(struct fpga_cfg_fpga_inst *inst,
+					     int bus, int slot, int func,
+					     const char *bdf)
 {
 	struct pci_dev *pdev;
 	struct device *dev;
@@ -427,16 +856,16 @@ static struct pci_dev *fpga_cfg_find_cvp_dev(struct fpga_cfg_fpga_inst *inst)
 
 	dev = &inst->cfg->pdev->dev;
 
-	devfn = PCI_DEVFN(inst->dev, inst->func);
+	devfn = PCI_DEVFN(slot, func);
 
 	if (inst->debug)
-		dev_dbg(dev, "find bus %02x, devfn %d\n", inst->bus, devfn);
+		dev_dbg(dev, "find bus %02x, devfn %d\n", bus, devfn);
 
-	pdev = pci_get_domain_bus_and_slot(0, inst->bus, devfn);
+	pdev = pci_get_domain_bus_and_slot(FPGA_CFG_PCI_DOMAIN, bus, devfn);
 	if (!pdev) {
 		if (inst->debug)
 			dev_dbg(dev, "Can't find CvP/PR PCIe device '%s'\n",
-				inst->bdf);
+				bdf);
 		return NULL;
 	}
 
@@ -446,8 +875,12 @@ static struct pci_dev *fpga_cfg_find_cvp_dev(struct fpga_cfg_fpga_inst *inst)
 	return pdev;
 }
 
-static char fpga_cfg_mgr_name_buf[128];
-static char fpga_cfg_mgr_name_addr_buf[16];
+/* PCIe FPGA device of the instance, called with load_lock held */
+static struct pci_dev *fpga_cfg_find_cvp_dev(struct fpga_cfg_fpga_inst *inst)
+{
+	return fpga_cfg_find_pci_dev(inst, inst->bus, inst->dev, inst->func,
+				     inst->bdf);
+}
 
 static int fpga_cfg_detach(struct device *dev, void *data)
 {
@@ -464,53 +897,56 @@ static int fpga_cfg_detach_mgrs(struct class *class)
 
 static int fpga_cfg_history_header(struct fpga_cfg_fpga_inst *inst)
 {
-	struct fpga_cfg_log_entry *log;
-	int len = 0, ret = 0;
-	char *buf;
-
-	buf = kmalloc(128, GFP_KERNEL);
-	if (!buf) {
-		ret = -ENOMEM;
-		goto err;
-	}
+	int len;
 
-	len += snprintf(buf, 128, "=== Config Log for %s device @ %s ===\n",
-			inst->type, inst->bdf);
+	mutex_lock(&inst->history_lock);
+	len = snprintf(inst->history_hdr, sizeof(inst->history_hdr),
+		       "=== Config Log for %s device @ %s ===\n",
+		       inst->type, inst->bdf);
+	inst->history_hdr_len = min_t(size_t, len,
+				      sizeof(inst->history_hdr) - 1);
+	inst->hist_count_new = inst->history_hdr_len + inst->history.bytes;
+	inst->history_header = true;
+	mutex_unlock(&inst->history_lock);
+	wake_up_interruptible(&inst->hist_queue);
+	return 0;
+}
 
-	log = kmalloc(sizeof(*log) + len + 1, GFP_KERNEL);
-	if (log) {
-		strncpy(log->entry, buf, len + 1);
-		log->len = len;
-		mutex_lock(&inst->history_lock);
-		list_add_tail(&log->list, &inst->history_list);
-		inst->hist_count_new += len;
-		inst->history_header = true;
-		mutex_unlock(&inst->history_lock);
-	} else {
-		kfree(buf);
-		ret = -ENOMEM;
-		goto err;
+static int fpga_cfg_history_alloc(struct fpga_cfg_fpga_inst *inst)
+{
+	inst->history.size = inst->history.max_entries *
+				 FPGA_CFG_HISTORY_ENTRY_BYTES;
+	inst->history.buf = vmalloc(inst->history.size);
+	inst->history.lens = vmalloc(inst->history.max_entries *
+				     sizeof(*inst->history.lens));
+	if (!inst->history.buf || !inst->history.lens) {
+		vfree(inst->history.buf);
+		vfree(inst->history.lens);
+		inst->history.buf = NULL;
+		inst->history.lens = NULL;
+		return -ENOMEM;
 	}
-	kfree(buf);
-	return ret;
-err:
-	dev_warn(&inst->cfg->pdev->dev, "No memory for log entry.\n");
-	return ret;
+	return 0;
 }
 
 static void fpga_cfg_free_log(struct fpga_cfg_fpga_inst *inst)
 {
-	struct fpga_cfg_log_entry *log, *tmp;
-
 	mutex_lock(&inst->history_lock);
-	list_for_each_entry_safe(log, tmp, &inst->history_list, list) {
-		list_del(&log->list);
-		kfree(log);
-	}
+	fpga_cfg_ring_reset(&inst->history);
+	inst->history_hdr_len = 0;
 	inst->history_header = false;
 	inst->hist_count = 0;
 	inst->hist_count_new = 0;
 	mutex_unlock(&inst->history_lock);
+	wake_up_interruptible(&inst->hist_queue);
+}
+
+/* Append an entry, dropping the oldest ones. Called with history_lock */
+static void fpga_cfg_history_add(struct fpga_cfg_fpga_inst *inst,
+				 const char *entry, size_t len)
+{
+	fpga_cfg_ring_add(&inst->history, entry, len);
+	inst->hist_count_new = inst->history_hdr_len + inst->history.bytes;
 }
 
 static void fpga_cfg_update_hist_attr(struct fpga_cfg_fpga_inst *inst)
@@ -525,79 +961,176 @@ static void fpga_cfg_update_hist_attr(struct fpga_cfg_fpga_inst *inst)
 	inode_unlock(d_inode(inst->dbgfs_history));
 }
 
-static ssize_t fpga_cfg_history_read(struct file *file, char __user *buf,
-				     size_t count, loff_t *ppos)
+/*
+ * Copy count bytes of the ring starting rel bytes after the oldest
+ * entry to user space. Called with history_lock held.
+ */
+static int fpga_cfg_history_copy(struct fpga_cfg_fpga_inst *inst,
+				 char __user *buf, size_t rel, size_t count)
 {
-	struct fpga_cfg_fpga_inst *inst = file->private_data;
-	struct fpga_cfg_log_entry *log, *tmp;
-	size_t read_cnt, read_max;
-	loff_t line_offs, offs = 0;
-	int ret;
+	const char *src;
+	size_t n, done = 0;
+
+	while (done < count) {
+		src = fpga_cfg_ring_seg(&inst->history, rel + done,
+					count - done, &n);
+		if (copy_to_user(buf + done, src, n))
+			return -EFAULT;
+		done += n;
+	}
+	return 0;
+}
 
-	if (!count)
-		return 0;
-	if (!inst->hist_count_new)
-		return 0;
-	if (*ppos >= inst->hist_count_new)
-		return 0;
+/*
+ * An open 'history' file. Once the ring is full the file doesn't grow
+ * any more, so poll compares the total of appended bytes with the one
+ * seen at the last read instead of the read position with the size.
+ */
+struct fpga_cfg_history_reader {
+	struct fpga_cfg_fpga_inst *inst;
+	u64 seen;
+};
 
-	read_cnt = 0;
-	read_max = count;
+/*
+ * The file offset maps directly to the header or to a ring position,
+ * so a read costs the same independent of the history length.
+ */
+static ssize_t fpga_cfg_history_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_history_reader *rd = file->private_data;
+	struct fpga_cfg_fpga_inst *inst = rd->inst;
+	size_t size, pos, n = 0;
+	ssize_t ret = 0;
 
 	mutex_lock(&inst->history_lock);
-
-	list_for_each_entry_safe(log, tmp, &inst->history_list, list) {
-
-		if (*ppos >= (offs + log->len)) {
-			offs += log->len;
-			continue;
+	rd->seen = inst->history.total;
+	size = inst->history_hdr_len + inst->history.bytes;
+	if (*ppos < 0 || *ppos >= size || !count)
+		goto out;
+	pos = *ppos;
+	count = min(count, size - pos);
+
+	if (pos < inst->history_hdr_len) {
+		n = min(count, inst->history_hdr_len - pos);
+		if (copy_to_user(buf, inst->history_hdr + pos, n)) {
+			ret = -EFAULT;
+			goto out;
 		}
+		pos += n;
+	}
+	if (fpga_cfg_history_copy(inst, buf + n, pos - inst->history_hdr_len,
+				  count - n)) {
+		ret = -EFAULT;
+		goto out;
+	}
 
-		line_offs = *ppos - offs;
+	*ppos += count;
+	inst->hist_count += count;
+	ret = count;
+out:
+	mutex_unlock(&inst->history_lock);
+	return ret;
+}
 
-		ret = simple_read_from_buffer(buf + read_cnt, read_max,
-					      &line_offs, log->entry, log->len);
-		if (ret < 0) {
-			mutex_unlock(&inst->history_lock);
-			if (read_cnt)
-				return read_cnt;
-			return ret;
-		}
+static unsigned int fpga_cfg_history_poll(struct file *file, poll_table *wait)
+{
+	struct fpga_cfg_history_reader *rd = file->private_data;
+	struct fpga_cfg_fpga_inst *inst = rd->inst;
+
+	poll_wait(file, &inst->hist_queue, wait);
+	if (file->f_pos < inst->hist_count_new ||
+	    READ_ONCE(inst->history.total) != READ_ONCE(rd->seen) ||
+	    inst->history_closed)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
 
-		read_max -= ret;
-		read_cnt += ret;
-		*ppos += ret;
-		inst->hist_count += ret;
+/*
+ * history_follow: the entries as stream, the file offset counts all
+ * bytes ever appended. Reads block until a new entry is logged, unless
+ * opened with O_NONBLOCK. Entries dropped before they were read are
+ * skipped.
+ */
+static ssize_t fpga_cfg_history_follow_read(struct file *file,
+					    char __user *buf, size_t count,
+					    loff_t *ppos)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	u64 first;
+	ssize_t ret;
 
-		if (read_cnt == count)
-			break;
+	if (!count)
+		return 0;
 
-		offs += log->len;
+	mutex_lock(&inst->history_lock);
+	while (*ppos >= inst->history.total) {
+		mutex_unlock(&inst->history_lock);
+		if (inst->history_closed)
+			return 0;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(inst->hist_queue,
+					     *ppos < inst->history.total ||
+					     inst->history_closed))
+			return -ERESTARTSYS;
+		mutex_lock(&inst->history_lock);
 	}
 
+	first = inst->history.total - inst->history.bytes;
+	if (*ppos < first)
+		*ppos = first;
+	count = min_t(u64, count, inst->history.total - *ppos);
+	ret = fpga_cfg_history_copy(inst, buf, *ppos - first, count);
+	if (!ret) {
+		*ppos += count;
+		ret = count;
+	}
 	mutex_unlock(&inst->history_lock);
+	return ret;
+}
+
+static unsigned int fpga_cfg_history_follow_poll(struct file *file,
+						 poll_table *wait)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
 
-	return read_cnt;
+	poll_wait(file, &inst->hist_queue, wait);
+	if (file->f_pos < inst->history.total || inst->history_closed)
+		return POLLIN | POLLRDNORM;
+	return 0;
 }
 
 static int fpga_cfg_history_open(struct inode *inode, struct file *file)
 {
+	struct fpga_cfg_history_reader *rd;
 	struct fpga_cfg_fpga_inst *inst;
 
-	if (inode->i_private) {
-		file->private_data = inode->i_private;
-		inst = inode->i_private;
-		inst->hist_count = 0;
-		return 0;
-	}
+	if (!inode->i_private)
+		return -ENODEV;
 
-	return -ENODEV;
+	rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+	if (!rd)
+		return -ENOMEM;
+
+	inst = inode->i_private;
+	rd->inst = inst;
+	file->private_data = rd;
+	inst->hist_count = 0;
+	return 0;
+}
+
+static int fpga_cfg_history_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
 }
 
 static ssize_t fpga_cfg_history_write(struct file *file, const char __user *buf,
 				      size_t count, loff_t *ppos)
 {
-	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	struct fpga_cfg_history_reader *rd = file->private_data;
+	struct fpga_cfg_fpga_inst *inst = rd->inst;
 	int ret, val;
 
 	ret = sscanf(buf, "%d", &val);
@@ -615,11 +1148,20 @@ static ssize_t fpga_cfg_history_write(struct file *file, const char __user *buf,
 
 static const struct file_operations dbgfs_history_ops = {
 	.open = fpga_cfg_history_open,
+	.release = fpga_cfg_history_release,
 	.read = fpga_cfg_history_read,
 	.write = fpga_cfg_history_write,
+	.poll = fpga_cfg_history_poll,
 	.llseek = default_llseek,
 };
 
+static const struct file_operations dbgfs_history_follow_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_history_follow_read,
+	.poll = fpga_cfg_history_follow_poll,
+	.llseek = no_llseek,
+};
+
 static ssize_t fpga_cfg_attr_show(struct kobject *kobj, struct attribute *attr,
 				  char *buf)
 {
@@ -655,22 +1197,6 @@ static const struct sysfs_ops fpga_cfg_sysfs_ops = {
 	.store = fpga_cfg_attr_store,
 };
 
-#if 0
-static ssize_t show_history(struct fpga_cfg_fpga_inst *inst,
-			    struct attribute *attr, char *buf)
-{
-	struct fpga_cfg_log_entry *log, *tmp;
-	int len = 0;
-
-	list_for_each_entry_safe(log, tmp, &inst->history_list, list) {
-		/*len += sprintf(buf + len, "%s", log->entry);*/
-		pr_debug("%d: %s", len++, log->entry);
-	}
-
-	return len;
-}
-#endif
-
 static ssize_t show_debug(struct fpga_cfg_fpga_inst *inst,
 			  struct attribute *attr, char *buf)
 {
@@ -687,280 +1213,267 @@ static ssize_t store_debug(struct fpga_cfg_fpga_inst *inst,
 static ssize_t show_load(struct fpga_cfg_fpga_inst *inst,
 			 struct attribute *attr, char *buf)
 {
-	return snprintf(buf, 3, "%d\n", inst->cfg_done);
+	return snprintf(buf, 3, "%d\n", atomic_read(&inst->cfg_done));
 }
 
 static ssize_t show_ready(struct fpga_cfg_fpga_inst *inst,
 			  struct attribute *attr, char *buf)
 {
-	return snprintf(buf, 3, "%d\n", inst->cfg_done);
+	return snprintf(buf, 3, "%d\n", atomic_read(&inst->cfg_done));
 }
 
 static ssize_t show_status(struct fpga_cfg_fpga_inst *inst,
 			   struct attribute *attr, char *buf)
 {
-	return snprintf(buf, 3, "%d\n", inst->cfg_done);
+	return snprintf(buf, 3, "%d\n", atomic_read(&inst->cfg_done));
 }
 
 /*
- * Helper functions and structures for parsing the config description
+ * Values of descriptions and binary entries are only bounded by VAL_SZ,
+ * check them against the size of their destination in req
  */
-#define KEY_SZ	64
-#define VAL_SZ	(PATH_MAX + NAME_MAX + 3)
-
-static DEFINE_MUTEX(parser_lock);
-static char key_buf[KEY_SZ];
-static char val_buf[VAL_SZ];
-struct key_type_tbl {
-	enum fpga_cfg_mgr_type type;
-	const char *key;
-	bool done;
-};
-
-struct key_type_tbl fpga_cfg_key_tbl[] = {
-	{ CFG_USB_ID,	"fpp-usb-dev-id" },
-	{ CFG_BUS_NR,	"fpga-pcie-bus-nr" },
-	{ CFG_TYPE,	"fpga-type" },
-	{ CFG_BS_LSB,	"spi-lsb-first" },
-	{ FPP_RING_MGR,	"fpp-image" },
-	{ SPI_RING_MGR,	"spi-image" },
-	{ CVP_MGR,	"cvp-image" },
-	{ PR_MGR,	"part-reconf-image" },
-	{ FPP_META,	"fpp-image-meta" },
-	{ SPI_META,	"spi-image-meta" },
-	{ CVP_META,	"cvp-image-meta" },
-	{ PR_META,	"part-reconf-image-meta" },
-	{ FPGA_DRV,	"mfd-driver" },
-	{ FPGA_DRV_ARGS, "mfd-driver-param" },
-};
-
-static void reset_key_tbl_search(void)
+static bool fpga_cfg_val_too_long(struct device *dev, const char *val,
+				  size_t size)
 {
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(fpga_cfg_key_tbl); i++)
-		fpga_cfg_key_tbl[i].done = 0;
+	if (strnlen(val, size) < size)
+		return false;
+	dev_err(dev, "Value too long (max %zu): '%.32s...'\n", size - 1, val);
+	return true;
 }
 
-static int parse_line(const char *line, char *key, char *val)
+/* Store the value of a parsed key in req */
+static int fpga_cfg_assign(struct fpga_cfg_fpga_inst *inst,
+			   struct fpga_cfg_req *req,
+			   enum fpga_cfg_mgr_type type, char *val)
 {
-	char fmt_key_val_pfx[] = "%23s = \"%";
-	char line_fmt_str[24] = "";
+	struct device *dev = &inst->cfg->pdev->dev;
+	char *dst, *dst_sub = NULL;
 	int ret;
+	size_t len;
 
-	/* Allow reading of key_values with spaces included */
-	snprintf(line_fmt_str, sizeof(line_fmt_str), "%s%d[^\n]",
-		 fmt_key_val_pfx, VAL_SZ);
-
-	ret = sscanf(line, line_fmt_str, key, val);
-	/*pr_debug("fmt: '%s' , ret %d\n", line_fmt_str, ret);*/
-	if (ret > 0)
-		return ret;
-
-	pr_err("Invalid line format.\n");
-	return -EINVAL;
-}
-
-static int chk_and_terminate_val(char *val)
-{
-	char *p;
-
-	/* check for trailing '";' and terminate the value string  */
-	p = strrchr(val, '"');
-	if (!p)
-		return 0;
-
-	if (p[1] != ';')
-		return 0;
-
-	p[0] = 0;
-
-	return 1;
-}
-
-static int assign_values(struct fpga_cfg_fpga_inst *inst,
-			 char *key, char *val)
-{
-	struct device *dev = &inst->cfg->pdev->dev;
-	char *dst, *dst_sub;
-	int i, ret;
-	size_t len;
-
-	for (i = 0; i < ARRAY_SIZE(fpga_cfg_key_tbl); i++) {
-		/* do not search for already processed key */
-		if (fpga_cfg_key_tbl[i].done)
-			continue;
-		if (strcmp(fpga_cfg_key_tbl[i].key, key))
-			continue;
-
-		fpga_cfg_key_tbl[i].done = 1;
-
-		if (!chk_and_terminate_val(val)) {
-			dev_err(dev, "Invalid line end: '%s'\n", val);
+	switch (type) {
+	case FPP_RING_MGR:
+		dst_sub = req->fpp.firmware;
+		dst = req->fpp.firmware_abs;
+		len = sizeof(req->fpp.firmware_abs);
+		req->cfg_op1 = FPP_RING_MGR;
+		break;
+	case SPI_RING_MGR:
+		dst_sub = req->spi.firmware;
+		dst = req->spi.firmware_abs;
+		len = sizeof(req->spi.firmware_abs);
+		req->cfg_op1 = inst->mgr_type;
+		break;
+	case CVP_MGR:
+		dst_sub = req->cvp.firmware;
+		dst = req->cvp.firmware_abs;
+		len = sizeof(req->cvp.firmware_abs);
+		req->cfg_op2 = CVP_MGR;
+		break;
+	case PR_MGR:
+		dst_sub = req->pr.firmware;
+		dst = req->pr.firmware_abs;
+		len = sizeof(req->pr.firmware_abs);
+		req->cfg_op1 = PR_MGR;
+		break;
+	case FPP_META:
+		dst = req->fpp.metadata_abs;
+		len = sizeof(req->fpp.metadata_abs);
+		break;
+	case SPI_META:
+		dst = req->spi.metadata_abs;
+		len = sizeof(req->spi.metadata_abs);
+		break;
+	case CVP_META:
+		dst = req->cvp.metadata_abs;
+		len = sizeof(req->cvp.metadata_abs);
+		break;
+	case PR_META:
+		dst = req->pr.metadata_abs;
+		len = sizeof(req->pr.metadata_abs);
+		break;
+	case CFG_BUS_NR:
+		if (sscanf(val, "%x:%x.%x",
+		    &req->bus, &req->dev, &req->func) != 3) {
+			dev_err(dev, "Invalid bus-nr: '%s'\n", val);
 			return -EINVAL;
 		}
-
-		dst_sub = NULL;
-
-		switch (fpga_cfg_key_tbl[i].type) {
-		case FPP_RING_MGR:
-			dst_sub = inst->fpp.firmware;
-			dst = inst->fpp.firmware_abs;
-			len = sizeof(inst->fpp.firmware_abs);
-			inst->cfg_op1 = FPP_RING_MGR;
-			break;
-		case SPI_RING_MGR:
-			dst_sub = inst->spi.firmware;
-			dst = inst->spi.firmware_abs;
-			len = sizeof(inst->spi.firmware_abs);
-			inst->cfg_op1 = inst->mgr_type;
-			break;
-		case CVP_MGR:
-			dst_sub = inst->cvp.firmware;
-			dst = inst->cvp.firmware_abs;
-			len = sizeof(inst->cvp.firmware_abs);
-			inst->cfg_op2 = CVP_MGR;
-			break;
-		case PR_MGR:
-			dst_sub = inst->pr.firmware;
-			dst = inst->pr.firmware_abs;
-			len = sizeof(inst->pr.firmware_abs);
-			inst->cfg_op1 = PR_MGR;
-			break;
-		case FPP_META:
-			dst = inst->fpp.metadata_abs;
-			len = sizeof(inst->fpp.metadata_abs);
-			break;
-		case SPI_META:
-			dst = inst->spi.metadata_abs;
-			len = sizeof(inst->spi.metadata_abs);
-			break;
-		case CVP_META:
-			dst = inst->cvp.metadata_abs;
-			len = sizeof(inst->cvp.metadata_abs);
-			break;
-		case PR_META:
-			dst = inst->pr.metadata_abs;
-			len = sizeof(inst->pr.metadata_abs);
-			break;
-		case CFG_BUS_NR:
-			if (sscanf(val, "%x:%x.%x",
-			    &inst->bus, &inst->dev, &inst->func) != 3) {
-				dev_err(dev, "Invalid bus-nr: '%s'\n", val);
-				return -EINVAL;
-			}
-			sscanf(val, "%s", inst->bdf);
-			if (inst->debug)
-				dev_dbg(dev, "BDF '%s'\n", inst->bdf);
-			return 0;
-		case CFG_USB_ID:
-			if (strncmp(val, inst->usb_dev_id,
-				    sizeof(inst->usb_dev_id))) {
-				dev_warn(dev, "FPP usb id '%s', expected '%s'\n",
-					 val, inst->usb_dev_id);
-			}
-			if (inst->debug)
-				dev_dbg(dev, "Using FPP dev '%s'\n", val);
-			return 0;
-		case CFG_TYPE:
-			if (sscanf(val, "%s", inst->type) != 1) {
-				dev_err(dev, "Invalid type '%s'\n", val);
-				return -EINVAL;
-			}
-			if (inst->debug)
-				dev_dbg(dev, "TYPE '%s'\n", inst->type);
-			return 0;
-		case CFG_BS_LSB:
-			if (sscanf(val, "%d", &inst->bs_lsb_first) != 1) {
-				dev_err(dev, "Invalid bitorder flag '%s'\n", val);
-				return -EINVAL;
-			}
-			if (inst->debug) {
-				dev_dbg(dev, "Bitstream LSB first flag '%d'\n",
-					inst->bs_lsb_first);
-			}
-			return 0;
-		case FPGA_DRV:
-			if (sscanf(val, "%s", inst->fpga_drv) != 1) {
-				dev_err(dev, "Invalid 'mfd-driver': '%s'\n", val);
-				return -EINVAL;
-			}
-			if (inst->debug)
-				dev_dbg(dev, "Using mfd-driver: '%s'\n", inst->fpga_drv);
-			return 0;
-		case FPGA_DRV_ARGS:
-			strncpy(inst->fpga_drv_args, val,
-				sizeof(inst->fpga_drv_args));
-			if (inst->debug)
-				dev_dbg(dev, "Using mfd-driver-param: '%s'\n",
-					inst->fpga_drv_args);
-			return 0;
-		default:
-			return 0;
+		if (fpga_cfg_val_too_long(dev, val, sizeof(req->bdf)))
+			return -EINVAL;
+		sscanf(val, "%15s", req->bdf);
+		if (inst->debug)
+			dev_dbg(dev, "BDF '%s'\n", req->bdf);
+		return 0;
+	case CFG_USB_ID:
+		if (strncmp(val, inst->usb_dev_id,
+			    sizeof(inst->usb_dev_id))) {
+			dev_warn(dev, "FPP usb id '%s', expected '%s'\n",
+				 val, inst->usb_dev_id);
 		}
-		strncpy(dst, val, len);
 		if (inst->debug)
-			dev_dbg(dev, "abs. name '%s'\n", dst);
-		if (dst_sub) {
-			ret = sscanf(val, "/lib/firmware/%s", dst_sub);
-			if (ret == 1) {
-				if (inst->debug)
-					dev_dbg(dev, "base name '%s'\n",
-						dst_sub);
-				return 0;
-			}
-			dev_err(dev,
-				"/lib/firmware/ prefix expected, found: %s\n",
-				val);
+			dev_dbg(dev, "Using FPP dev '%s'\n", val);
+		return 0;
+	case CFG_TYPE:
+		if (fpga_cfg_val_too_long(dev, val, sizeof(req->type)))
+			return -EINVAL;
+		if (sscanf(val, "%15s", req->type) != 1) {
+			dev_err(dev, "Invalid type '%s'\n", val);
+			return -EINVAL;
+		}
+		if (inst->debug)
+			dev_dbg(dev, "TYPE '%s'\n", req->type);
+		return 0;
+	case CFG_BS_LSB:
+		if (sscanf(val, "%d", &req->bs_lsb_first) != 1) {
+			dev_err(dev, "Invalid bitorder flag '%s'\n", val);
+			return -EINVAL;
+		}
+		if (inst->debug) {
+			dev_dbg(dev, "Bitstream LSB first flag '%d'\n",
+				req->bs_lsb_first);
+		}
+		return 0;
+	case FPGA_DRV:
+		if (fpga_cfg_val_too_long(dev, val, sizeof(req->fpga_drv)))
+			return -EINVAL;
+		if (sscanf(val, "%47s", req->fpga_drv) != 1) {
+			dev_err(dev, "Invalid 'mfd-driver': '%s'\n", val);
+			return -EINVAL;
+		}
+		if (inst->debug)
+			dev_dbg(dev, "Using mfd-driver: '%s'\n", req->fpga_drv);
+		return 0;
+	case FPGA_DRV_ARGS:
+		if (fpga_cfg_val_too_long(dev, val,
+					  sizeof(req->fpga_drv_args)))
+			return -EINVAL;
+		strscpy(req->fpga_drv_args, val, sizeof(req->fpga_drv_args));
+		if (inst->debug)
+			dev_dbg(dev, "Using mfd-driver-param: '%s'\n",
+				req->fpga_drv_args);
+		return 0;
+	case PR_REGION:
+		if (kstrtouint(val, 0, &req->pr_region) ||
+		    req->pr_region >= FPGA_CFG_PR_REGIONS) {
+			dev_err(dev, "Invalid PR region '%s'\n", val);
+			return -EINVAL;
+		}
+		if (inst->debug)
+			dev_dbg(dev, "PR region %u\n", req->pr_region);
+		return 0;
+	case PR_PRIO:
+		if (kstrtouint(val, 0, &req->pr_prio) ||
+		    req->pr_prio > FPGA_CFG_PR_PRIO_MAX) {
+			dev_err(dev, "Invalid PR priority '%s'\n", val);
 			return -EINVAL;
 		}
+		if (inst->debug)
+			dev_dbg(dev, "PR priority %u\n", req->pr_prio);
+		return 0;
+	default:
+		return 0;
+	}
+	if (fpga_cfg_val_too_long(dev, val, len))
+		return -EINVAL;
+	strscpy(dst, val, len);
+	if (inst->debug)
+		dev_dbg(dev, "abs. name '%s'\n", dst);
+	if (dst_sub) {
+		/* the base names of all steps have the same size */
+		if (!strncmp(val, "/lib/firmware/", 14) &&
+		    fpga_cfg_val_too_long(dev, val + 14,
+					  sizeof(req->fpp.firmware)))
+			return -EINVAL;
+		ret = sscanf(val, "/lib/firmware/%s", dst_sub);
+		if (ret == 1) {
+			if (inst->debug)
+				dev_dbg(dev, "base name '%s'\n", dst_sub);
+			return 0;
+		}
+		dev_err(dev, "/lib/firmware/ prefix expected, found: %s\n",
+			val);
+		return -EINVAL;
 	}
 	return 0;
 }
 
+static void fpga_cfg_req_init(struct fpga_cfg_req *req)
+{
+	req->cfg_op1 = NOP_MGR;
+	req->cfg_op2 = NOP_MGR;
+	strncpy(req->fpga_drv, "fpga_mfd", sizeof(req->fpga_drv));
+}
+
+/*
+ * Parse the description into req in a single pass over its lines.
+ * Unknown keys are ignored, of duplicate keys the first one is used.
+ * All parser state is local to the call, so descriptions for different
+ * instances are parsed in parallel.
+ */
 static int fpga_cfg_desc_parse(struct fpga_cfg_fpga_inst *inst,
+			       struct fpga_cfg_req *req,
 			       const char *buf, size_t size)
 {
-	struct fpga_cfg *cfg = inst->cfg;
-	struct device *dev = &cfg->pdev->dev;
-	const char *p, *line, *end;
-	int ret;
+	struct device *dev = &inst->cfg->pdev->dev;
+	const char *line, *eol, *last, *err;
+	enum fpga_cfg_mgr_type type;
+	struct fpga_cfg_tok tok;
+	unsigned int lnum = 1;
+	const char *msg;
+	char *val;
+	int ret = 0;
+
+	val = kmalloc(VAL_SZ + 1, GFP_KERNEL);
+	if (!val)
+		return -ENOMEM;
 
-	/* process data buffer until trailing "\n}\n" */
-	p = buf;
-	end = buf + size - 3;
+	fpga_cfg_req_init(req);
 
-	mutex_lock(&parser_lock);
-	reset_key_tbl_search();
+	/* lines between leading "{\n" and the '\n' of trailing "\n}\n" */
+	last = buf + size - 3;
+	for (line = buf + 2; line <= last; line = eol + 1) {
+		lnum++;
+		eol = memchr(line, '\n', last + 1 - line);
 
-	while (p < end) {
-		if (*p == '\n') {
-			line = p + 1;
-			ret = parse_line(line, key_buf, val_buf);
-			if (ret <= 1) {
-				dev_err(dev, "parse error: '%s'\n", line);
-				mutex_unlock(&parser_lock);
-				return -EINVAL;
-			}
-			ret = assign_values(inst, key_buf, val_buf);
-			if (ret < 0) {
-				mutex_unlock(&parser_lock);
-				return ret;
-			}
+		err = fpga_cfg_parse_line(line, eol, &tok, &msg);
+		if (err) {
+			dev_err(dev, "parse error, line %u col %zu: %s\n",
+				lnum, (size_t)(err - line) + 1, msg);
+			if (inst->debug)
+				dev_dbg(dev, "'%.*s'\n", (int)(eol - line),
+					line);
+			ret = -EINVAL;
+			break;
+		}
+
+		type = fpga_cfg_key_lookup(tok.key, tok.key_len);
+		if (type == NOP_MGR || (req->keys & BIT(type)))
+			continue;
+
+		req->keys |= BIT(type);
+		memcpy(val, tok.val, tok.val_len);
+		val[tok.val_len] = '\0';
+
+		ret = fpga_cfg_assign(inst, req, type, val);
+		if (ret < 0) {
+			dev_err(dev, "line %u: invalid '%.*s'\n", lnum,
+				(int)tok.key_len, tok.key);
+			break;
 		}
-		p++;
 	}
-	mutex_unlock(&parser_lock);
-	return 0;
+	kfree(val);
+	return ret < 0 ? ret : 0;
 }
 
 static int fpga_cfg_op_log(struct fpga_cfg_fpga_inst *inst,
 			   struct cfg_desc *desc)
 {
-	struct fpga_cfg_log_entry *log, *hdr, *first;
 	unsigned long rem_nsec;
-	int len, ret = 0;
+	int len;
 
+	/* PR loads of different regions are logged concurrently */
+	mutex_lock(&inst->history_lock);
+	inst->cfg_seq_num += 1;
 	desc->cfg_ts_nsec = local_clock();
 	rem_nsec = do_div(desc->cfg_ts_nsec, 1000000000);
 	len = snprintf(desc->log_tmp, sizeof(desc->log_tmp),
@@ -968,41 +1481,16 @@ static int fpga_cfg_op_log(struct fpga_cfg_fpga_inst *inst,
 			(unsigned long)desc->cfg_ts_nsec,
 			rem_nsec / 1000, inst->cfg_seq_num,
 			desc->firmware_abs, desc->metadata_abs);
-
-	log = kmalloc(sizeof(*log) + len + 1, GFP_KERNEL);
-	if (log) {
-		strncpy(log->entry, desc->log_tmp, len + 1);
-		log->len = len;
-		mutex_lock(&inst->history_lock);
-		list_add_tail(&log->list, &inst->history_list);
-		inst->history_entries++;
-		mutex_unlock(&inst->history_lock);
-	} else {
-		dev_warn(&inst->cfg->pdev->dev, "No memory for log entry.\n");
-		return -ENOMEM;
-	}
-
-	if (inst->history_entries > inst->history_max_entries) {
-		mutex_lock(&inst->history_lock);
-		hdr = list_first_entry(&inst->history_list,
-				       struct fpga_cfg_log_entry,
-				       list);
-		if (hdr) {
-			first = list_next_entry(hdr, list);
-			inst->hist_count_new -= first->len;
-			inst->history_entries--;
-			pr_debug("hist. len %zi, delete entry '%s'\n",
-				 inst->history_entries, first->entry);
-			list_del(&first->list);
-			kfree(first);
-		}
-		mutex_unlock(&inst->history_lock);
-	}
-
-	inst->hist_count_new += len;
+	len = min_t(int, len, sizeof(desc->log_tmp) - 1);
+	fpga_cfg_history_add(inst, desc->log_tmp, len);
+	trace_fpga_cfg_history_add(inst->cfg->dir_buf, inst->cfg_seq_num, len,
+				   inst->history.total,
+				   inst->history.entries);
+	mutex_unlock(&inst->history_lock);
 	fpga_cfg_update_hist_attr(inst);
+	wake_up_interruptible(&inst->hist_queue);
 
-	return ret;
+	return 0;
 }
 
 #define PCI_DEV_ADDED	1
@@ -1116,36 +1604,141 @@ static void pci_device_driver_unbind(struct device *dev)
 	/*put_device(dev);*/
 }
 
+/* Called with pr_cache_lock held */
+static void fpga_cfg_pr_drop(struct fpga_cfg_pr_region *r)
+{
+	if (!r->desc.mgr)
+		return;
+
+	mutex_lock(&pci_wait_lock);
+	hash_del(&r->cache_node);
+	mutex_unlock(&pci_wait_lock);
+	put_device(&r->desc.mgr->dev);
+	pci_dev_put(r->pdev);
+	r->desc.mgr = NULL;
+	r->pdev = NULL;
+}
+
+/* Whether a PR region holds handles of pdev */
+static bool fpga_cfg_pr_cached(struct pci_dev *pdev, u32 key)
+{
+	struct fpga_cfg_pr_region *r;
+	bool found = false;
+
+	mutex_lock(&pci_wait_lock);
+	hash_for_each_possible(pr_cache, r, cache_node, key) {
+		if (r->pdev == pdev) {
+			found = true;
+			break;
+		}
+	}
+	mutex_unlock(&pci_wait_lock);
+	return found;
+}
+
+/* Drop the PR handles of a device before its driver is unbound */
+static void fpga_cfg_pr_invalidate(struct pci_dev *pdev)
+{
+	struct fpga_cfg_pr_region *r;
+	struct hlist_node *tmp;
+	u32 key;
+
+	key = FPGA_CFG_PCI_KEY(pci_domain_nr(pdev->bus), pdev->bus->number,
+			       pdev->devfn);
+	if (!fpga_cfg_pr_cached(pdev, key))
+		return;
+
+	mutex_lock(&pr_cache_lock);
+	hash_for_each_possible_safe(pr_cache, r, tmp, cache_node, key) {
+		if (r->pdev != pdev)
+			continue;
+		if (r->inst->debug)
+			dev_dbg(&pdev->dev, "Drop PR region %u manager handle\n",
+				r->idx);
+		fpga_cfg_pr_drop(r);
+		r->invalidations++;
+	}
+	mutex_unlock(&pr_cache_lock);
+}
+
+/*
+ * Register inst for the bind/unbind events of its device, at most once.
+ * A registration for a former bus/dev/func of inst is moved to the new key.
+ */
+static void fpga_cfg_wait_add(struct fpga_cfg_fpga_inst *inst)
+{
+	u32 key;
+
+	key = FPGA_CFG_PCI_KEY(FPGA_CFG_PCI_DOMAIN, inst->bus,
+			       PCI_DEVFN(inst->dev, inst->func));
+
+	mutex_lock(&pci_wait_lock);
+	if (hash_hashed(&inst->wait_node)) {
+		if (inst->wait_key == key)
+			goto out;
+		hash_del(&inst->wait_node);
+	}
+	inst->wait_key = key;
+	hash_add(pci_dev_waiters, &inst->wait_node, key);
+out:
+	mutex_unlock(&pci_wait_lock);
+}
+
+static void fpga_cfg_wait_del(struct fpga_cfg_fpga_inst *inst)
+{
+	mutex_lock(&pci_wait_lock);
+	hash_del(&inst->wait_node);
+	mutex_unlock(&pci_wait_lock);
+}
+
+/* Called with pci_wait_lock held */
+static struct fpga_cfg_fpga_inst *fpga_cfg_wait_find(struct pci_dev *pdev)
+{
+	struct fpga_cfg_fpga_inst *inst;
+	u32 key;
+
+	key = FPGA_CFG_PCI_KEY(pci_domain_nr(pdev->bus), pdev->bus->number,
+			       pdev->devfn);
+	hash_for_each_possible(pci_dev_waiters, inst, wait_node, key) {
+		if (inst->wait_key == key)
+			return inst;
+	}
+	return NULL;
+}
+
 static int pci_bus_event_notify(struct notifier_block *nb,
 				unsigned long action, void *data)
 {
-	struct fpga_cfg_fpga_inst *inst, *tmp_inst;
+	struct fpga_cfg_fpga_inst *inst;
 	struct device *dev = data;
 	struct pci_dev *pdev = to_pci_dev(dev);
-	bool dev_waiting = false;
 
 	switch (action) {
+	case BUS_NOTIFY_UNBIND_DRIVER:
+		fpga_cfg_pr_invalidate(pdev);
+		return 0;
 	case BUS_NOTIFY_BIND_DRIVER:
 	case BUS_NOTIFY_BOUND_DRIVER:
 	case BUS_NOTIFY_UNBOUND_DRIVER:
-		list_for_each_entry_safe(inst, tmp_inst,
-					 &pci_dev_wait_list, link) {
-			if (pdev->bus->number == inst->bus &&
-			    pdev->devfn == PCI_DEVFN(inst->dev, inst->func)) {
-				if (inst->debug)
-					dev_dbg(dev, "%s: %02x:%02x.%d\n",
-						__func__, inst->bus,
-						inst->dev, inst->func);
-				dev_waiting = true;
-				break;
-			}
-		}
 		break;
+	default:
+		return 0;
 	}
 
+	mutex_lock(&pci_wait_lock);
+	inst = fpga_cfg_wait_find(pdev);
+	if (!inst)
+		goto out;
+
+	if (inst->debug)
+		dev_dbg(dev, "%s: %02x:%02x.%d\n", __func__, inst->bus,
+			inst->dev, inst->func);
+	trace_fpga_cfg_pci_event(inst->cfg->dir_buf, pci_name(pdev), action,
+				 dev_driver_string(dev));
+
 	switch (action) {
 	case BUS_NOTIFY_BIND_DRIVER:
-		if (dev_waiting && inst->driver_to_bind) {
+		if (inst->driver_to_bind) {
 			const char *drv_name;
 
 			if (pdev->driver_override)
@@ -1167,22 +1760,19 @@ static int pci_bus_event_notify(struct notifier_block *nb,
 		}
 		break;
 	case BUS_NOTIFY_BOUND_DRIVER:
-		if (dev_waiting) {
-			list_del_init(&inst->link);
-			inst->drv_bound = true;
-			inst->pci_dev = pdev;
-			wake_up(&inst->wq_bind);
-		}
+		hash_del(&inst->wait_node);
+		inst->drv_bound = true;
+		inst->pci_dev = pdev;
+		wake_up(&inst->wq_bind);
 		break;
 	case BUS_NOTIFY_UNBOUND_DRIVER:
-		if (dev_waiting) {
-			list_del_init(&inst->link);
-			inst->drv_bound = false;
-			wake_up(&inst->wq_unbind);
-		}
+		hash_del(&inst->wait_node);
+		inst->drv_bound = false;
+		wake_up(&inst->wq_unbind);
 		break;
 	}
-
+out:
+	mutex_unlock(&pci_wait_lock);
 	return 0;
 }
 
@@ -1190,375 +1780,4222 @@ static struct notifier_block pci_bus_notifier = {
 	.notifier_call = pci_bus_event_notify,
 };
 
-static inline bool inst_is_fpp(struct fpga_cfg_fpga_inst *inst)
+static void fpga_cfg_lat_add(struct fpga_cfg_lat_hist *h, u64 ns)
 {
-	if (inst->cfg_op1 == FPP_RING_MGR)
-		return true;
-	return false;
+	u64 ms = div_u64(ns, NSEC_PER_MSEC);
+	int idx = ms ? min_t(int, fls64(ms), FPGA_CFG_LAT_BUCKETS - 1) : 0;
+
+	spin_lock(&h->lock);
+	if (!h->count || ns < h->min_ns)
+		h->min_ns = ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->count++;
+	h->sum_ns += ns;
+	h->last_ns = ns;
+	h->buckets[idx]++;
+	spin_unlock(&h->lock);
 }
 
-static int fpga_cfg_do_cvp(struct fpga_cfg_fpga_inst *inst)
+static int fpga_cfg_lat_print(struct fpga_cfg_lat_hist *h, const char *name,
+			      char *buf, size_t size)
 {
-	struct pci_bus __maybe_unused *bus;
-	struct fpga_manager *mgr;
-	struct pci_dev *pdev;
-	struct device *dev;
-	struct fpga_image_info info;
-	int ret;
+	struct fpga_cfg_lat_snap tmp;
+	int i, len;
+
+	spin_lock(&h->lock);
+	tmp.count = h->count;
+	tmp.min_ns = h->min_ns;
+	tmp.max_ns = h->max_ns;
+	tmp.sum_ns = h->sum_ns;
+	tmp.last_ns = h->last_ns;
+	memcpy(tmp.buckets, h->buckets, sizeof(tmp.buckets));
+	spin_unlock(&h->lock);
+
+	len = scnprintf(buf, size,
+			"%s: count %llu min %llu max %llu avg %llu last %llu us\n",
+			name, tmp.count, div_u64(tmp.min_ns, NSEC_PER_USEC),
+			div_u64(tmp.max_ns, NSEC_PER_USEC),
+			tmp.count ? div_u64(div64_u64(tmp.sum_ns, tmp.count),
+					    NSEC_PER_USEC) : 0,
+			div_u64(tmp.last_ns, NSEC_PER_USEC));
+	for (i = 0; i < FPGA_CFG_LAT_BUCKETS - 1; i++)
+		len += scnprintf(buf + len, size - len, "  <%u ms: %llu\n",
+				 1U << i, tmp.buckets[i]);
+	len += scnprintf(buf + len, size - len, "  >=%u ms: %llu\n",
+			 1U << (i - 1), tmp.buckets[i]);
+	return len;
+}
 
-	dev = &inst->cfg->pdev->dev;
+/* Bytes per second, bytes * NSEC_PER_SEC overflows beyond 18 GB */
+static u64 fpga_cfg_bps(u64 bytes, u64 ns)
+{
+	if (!ns)
+		return 0;
+	if (bytes <= div64_u64(U64_MAX, NSEC_PER_SEC))
+		return div64_u64(bytes * NSEC_PER_SEC, ns);
+	return div64_u64(bytes, div64_u64(ns, NSEC_PER_MSEC) ?: 1) *
+	       MSEC_PER_SEC;
+}
 
-	memset(&info, 0, sizeof(info));
-	inst->cfg_done = false;
-	inst->driver_to_bind = NULL;
+static int fpga_cfg_tput_print(struct fpga_cfg_tput *t, const char *name,
+			       char *buf, size_t size)
+{
+	struct fpga_cfg_tput_snap tmp;
+
+	spin_lock(&t->lock);
+	tmp.loads = t->loads;
+	tmp.bytes = t->bytes;
+	tmp.ns = t->ns;
+	tmp.last_bps = t->last_bps;
+	spin_unlock(&t->lock);
+
+	return scnprintf(buf, size,
+			 "%s: loads %llu bytes %llu avg %llu last %llu B/s\n",
+			 name, tmp.loads, tmp.bytes,
+			 fpga_cfg_bps(tmp.bytes, tmp.ns), tmp.last_bps);
+}
 
-	pdev = inst->pci_dev;
-	if (!pdev) {
-		pdev = fpga_cfg_find_cvp_dev(inst);
-		if (!pdev) {
-			dev_dbg(dev, "PCIe FPGA dev for CvP not found.\n");
-			return -ENODEV;
-		}
-	}
+/* Notify 'progress' pollers, delayed to keep FPGA_CFG_PROGRESS_MS */
+static void fpga_cfg_progress_notify(struct fpga_cfg_fpga_inst *inst)
+{
+	struct fpga_cfg_progress *p = &inst->progress;
+	unsigned long next;
 
-	inst->cvp.mgr_dev = &pdev->dev;
+	spin_lock(&p->lock);
+	next = p->notified + msecs_to_jiffies(FPGA_CFG_PROGRESS_MS);
+	spin_unlock(&p->lock);
 
-	mgr = fpga_mgr_get(&pdev->dev);
-	if (IS_ERR(mgr)) {
-		ret = PTR_ERR(mgr);
-		dev_err(dev, "failed getting CvP manager: %d\n", ret);
-		return ret;
-	}
-	if (inst->debug) {
-		dev_info(dev, "CvP cfg step start\n");
-		dev_info(dev, "Using CvP manager: '%s'\n", mgr->name);
-	}
+	schedule_delayed_work(&inst->progress_work,
+			      time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+/* Rearmed while a write runs, so pollers see the estimated bytes grow */
+static void fpga_cfg_progress_work(struct work_struct *work)
+{
+	struct fpga_cfg_fpga_inst *inst = container_of(to_delayed_work(work),
+					struct fpga_cfg_fpga_inst,
+					progress_work);
+	struct fpga_cfg_progress *p = &inst->progress;
+	bool writing;
+
+	spin_lock(&p->lock);
+	p->notified = jiffies;
+	writing = p->running && p->stage == FPGA_CFG_STAGE_WRITE &&
+		  p->avg_bps;
+	spin_unlock(&p->lock);
+
+	sysfs_notify(&inst->kobj_fpga_dir, NULL, "progress");
+	if (writing)
+		schedule_delayed_work(&inst->progress_work,
+				      msecs_to_jiffies(FPGA_CFG_PROGRESS_MS));
+}
 
-	inst->cvp.mgr = mgr;
 #if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
-	info.firmware_name = inst->cvp.firmware;
-	ret = fpga_mgr_load(inst->cvp.mgr, &info);
-#else
-	ret = fpga_mgr_firmware_load(inst->cvp.mgr, &info,
-				     inst->cvp.firmware);
+static void fpga_cfg_tput_add(struct fpga_cfg_tput *t, size_t bytes, u64 ns)
+{
+	spin_lock(&t->lock);
+	t->loads++;
+	t->bytes += bytes;
+	t->ns += ns;
+	t->last_bps = fpga_cfg_bps(bytes, ns);
+	spin_unlock(&t->lock);
+}
+
+/* Take the throughput of the manager used for the write stage */
+static void fpga_cfg_progress_rate(struct fpga_cfg_fpga_inst *inst,
+				   struct fpga_cfg_tput *t)
+{
+	struct fpga_cfg_progress *p = &inst->progress;
+	u64 last, avg;
+
+	spin_lock(&t->lock);
+	last = t->last_bps;
+	avg = fpga_cfg_bps(t->bytes, t->ns);
+	spin_unlock(&t->lock);
+
+	spin_lock(&p->lock);
+	p->last_bps = last;
+	p->avg_bps = avg;
+	spin_unlock(&p->lock);
+}
 #endif
-	if (ret < 0) {
-		fpga_mgr_put(mgr);
-		inst->cvp.mgr = NULL;
-		goto err;
-	}
-	inst->cfg_seq_num += 1;
-	inst->cfg_done = true;
-	fpga_cfg_op_log(inst, &inst->cvp);
-	fpga_mgr_put(mgr);
-	inst->cvp.mgr = NULL;
-	if (inst->debug)
-		dev_info(dev, "CvP cfg step done\n");
 
-#if 0
-		/* Shouldn't be needed with working hotplug */
-		if (pdev->vendor == 0x1172 &&
-		    (pdev->device == 0xe003 || pdev->device == 0xe001)) {
-			if (inst->debug)
-				dev_dbg(dev, "Reattach CvP device\n");
-			bus = pdev->bus;
-			/* Unbind and remove the PCIe FPGA device first */
-			pci_lock_rescan_remove();
-			pci_dev_get(pdev);
-			pci_stop_and_remove_bus_device(pdev);
+/*
+ * Generic netlink family for load events, see fpga-cfg-genl.h. It has
+ * no commands, userspace only joins the "events" multicast group.
+ */
+static const struct genl_multicast_group fpga_cfg_genl_mcgrps[] = {
+	{ .name = FPGA_CFG_GENL_MCGRP_EVENTS, },
+};
+
+static struct genl_family fpga_cfg_genl_family = {
+	.name = FPGA_CFG_GENL_NAME,
+	.version = FPGA_CFG_GENL_VERSION,
+	.module = THIS_MODULE,
+	.mcgrps = fpga_cfg_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(fpga_cfg_genl_mcgrps),
+};
+
+/* Event size without image paths */
+#define FPGA_CFG_GENL_MSG_SZ	256
+
+static int fpga_cfg_genl_register(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+	return genl_register_family_with_mcgrps(&fpga_cfg_genl_family,
+						fpga_cfg_genl_mcgrps);
+#else
+	return genl_register_family(&fpga_cfg_genl_family);
+#endif
+}
+
+/* Allocate an event with the attributes common to all events */
+static struct sk_buff *fpga_cfg_genl_new(struct fpga_cfg_fpga_inst *inst,
+					 u8 cmd, size_t size, u64 seq,
+					 int ret, u64 ns, void **hdr)
+{
+	struct sk_buff *skb;
+
+	if (!genl_has_listeners(&fpga_cfg_genl_family, &init_net, 0))
+		return NULL;
+
+	skb = genlmsg_new(size, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	*hdr = genlmsg_put(skb, 0, 0, &fpga_cfg_genl_family, 0, cmd);
+	if (!*hdr)
+		goto err;
+	if (nla_put_string(skb, FPGA_CFG_ATTR_INSTANCE, inst->cfg->dir_buf) ||
+	    nla_put_u64_64bit(skb, FPGA_CFG_ATTR_SEQ, seq,
+			      FPGA_CFG_ATTR_PAD) ||
+	    nla_put_s32(skb, FPGA_CFG_ATTR_RESULT, ret) ||
+	    nla_put_u64_64bit(skb, FPGA_CFG_ATTR_DURATION_NS, ns,
+			      FPGA_CFG_ATTR_PAD))
+		goto err;
+	return skb;
+err:
+	nlmsg_free(skb);
+	return NULL;
+}
+
+static void fpga_cfg_genl_stage_end(struct fpga_cfg_fpga_inst *inst,
+				    u64 seq, enum fpga_cfg_stage stage,
+				    u64 ns, size_t bytes, int ret)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = fpga_cfg_genl_new(inst, FPGA_CFG_CMD_STAGE_END,
+				FPGA_CFG_GENL_MSG_SZ, seq, ret, ns, &hdr);
+	if (!skb)
+		return;
+
+	if (nla_put_string(skb, FPGA_CFG_ATTR_STAGE,
+			   fpga_cfg_stage_str[stage]) ||
+	    nla_put_u64_64bit(skb, FPGA_CFG_ATTR_BYTES, bytes,
+			      FPGA_CFG_ATTR_PAD)) {
+		nlmsg_free(skb);
+		return;
+	}
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&fpga_cfg_genl_family, skb, 0, 0, GFP_KERNEL);
+}
+
+/* Image path of desc for events, NULL for uploaded or unset images */
+static const char *fpga_cfg_genl_image(struct cfg_desc *desc)
+{
+	if (!desc || desc->upload || !desc->firmware_abs[0])
+		return NULL;
+	return desc->firmware_abs;
+}
+
+/*
+ * Report the end of a load, desc is the first configuration step, cvp
+ * the CvP step if any. region is the PR region or -1.
+ */
+static void fpga_cfg_genl_load_end(struct fpga_cfg_fpga_inst *inst,
+				   u64 seq, int ret, u64 ns,
+				   struct cfg_desc *desc, struct cfg_desc *cvp,
+				   int region)
+{
+	const char *image = fpga_cfg_genl_image(desc);
+	const char *cvp_image = fpga_cfg_genl_image(cvp);
+	size_t size = FPGA_CFG_GENL_MSG_SZ;
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (image)
+		size += nla_total_size(strlen(image) + 1);
+	if (cvp_image)
+		size += nla_total_size(strlen(cvp_image) + 1);
+
+	skb = fpga_cfg_genl_new(inst, FPGA_CFG_CMD_LOAD_END, size, seq, ret,
+				ns, &hdr);
+	if (!skb)
+		return;
+
+	if ((image && nla_put_string(skb, FPGA_CFG_ATTR_IMAGE, image)) ||
+	    (cvp_image &&
+	     nla_put_string(skb, FPGA_CFG_ATTR_CVP_IMAGE, cvp_image)) ||
+	    (region >= 0 &&
+	     nla_put_u32(skb, FPGA_CFG_ATTR_PR_REGION, region))) {
+		nlmsg_free(skb);
+		return;
+	}
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&fpga_cfg_genl_family, skb, 0, 0, GFP_KERNEL);
+}
+
+static u64 fpga_cfg_stage_begin(struct fpga_cfg_fpga_inst *inst, u64 seq,
+				enum fpga_cfg_stage stage)
+{
+	struct fpga_cfg_progress *p = &inst->progress;
+	u64 now = local_clock();
+
+	trace_fpga_cfg_stage_start(inst->cfg->dir_buf, seq,
+				   fpga_cfg_stage_str[stage], 0, 0);
+	/* parsing is not part of a load, see fpga_cfg_run() */
+	if (!seq)
+		return now;
+
+	spin_lock(&p->lock);
+	p->seq = seq;
+	p->stage = stage;
+	p->running = true;
+	p->ret = 0;
+	p->start_ns = now;
+	if (stage == FPGA_CFG_STAGE_FETCH) {
+		p->bytes_total = 0;
+		p->bytes_done = 0;
+	}
+	spin_unlock(&p->lock);
+	fpga_cfg_progress_notify(inst);
+	return now;
+}
+
+/* Trace the end of a stage, successful stages are added to 'stats' */
+static void fpga_cfg_stage_end(struct fpga_cfg_fpga_inst *inst, u64 seq,
+			       enum fpga_cfg_stage stage, u64 start,
+			       size_t bytes, int ret)
+{
+	struct fpga_cfg_progress *p = &inst->progress;
+	u64 now = local_clock();
+
+	trace_fpga_cfg_stage_end(inst->cfg->dir_buf, seq,
+				 fpga_cfg_stage_str[stage], bytes, ret);
+	if (ret >= 0)
+		fpga_cfg_lat_add(&inst->stage_lat[stage], now - start);
+	if (!seq)
+		return;
+
+	fpga_cfg_genl_stage_end(inst, seq, stage, now - start, bytes, ret);
+
+	spin_lock(&p->lock);
+	p->seq = seq;
+	p->stage = stage;
+	p->running = false;
+	p->ret = ret;
+	p->start_ns = start;
+	p->end_ns = now;
+	if (stage == FPGA_CFG_STAGE_FETCH)
+		p->bytes_total = bytes;
+	else if (stage == FPGA_CFG_STAGE_WRITE && ret >= 0)
+		p->bytes_done = bytes;
+	spin_unlock(&p->lock);
+	fpga_cfg_progress_notify(inst);
+}
+
+/*
+ * Wait for the FPGA PCIe device to come up after the ring image load
+ * and get bound to inst->driver_to_bind. Hotplug usually signals the
+ * device early, if it doesn't, the device is looked up and the bus
+ * rescanned with increasing intervals until linkup_timeout_ms.
+ * Called with the instance registered by fpga_cfg_wait_add().
+ */
+static int fpga_cfg_wait_linkup(struct fpga_cfg_fpga_inst *inst)
+{
+	struct device *dev = &inst->cfg->pdev->dev;
+	unsigned int poll_ms = FPGA_CFG_LINKUP_POLL_MS;
+	unsigned long deadline, tmo;
+	struct pci_dev *pdev;
+	struct pci_bus *bus;
+	u64 start;
+
+	start = fpga_cfg_stage_begin(inst, inst->load_seq_cur,
+				     FPGA_CFG_STAGE_LINKUP);
+	deadline = jiffies + msecs_to_jiffies(inst->linkup_timeout_ms);
+
+	while (time_before(jiffies, deadline)) {
+		tmo = min(msecs_to_jiffies(poll_ms), deadline - jiffies);
+		if (wait_event_timeout(inst->wq_bind, inst->drv_bound, tmo))
+			break;
+
+		pdev = fpga_cfg_find_cvp_dev(inst);
+		if (pdev) {
+			/* device is there, but no driver bound yet */
+			if (!pdev->driver)
+				pci_device_driver_bind(pdev, inst,
+						       inst->driver_to_bind);
 			pci_dev_put(pdev);
-			pci_unlock_rescan_remove();
+		} else {
+			bus = pci_find_bus(FPGA_CFG_PCI_DOMAIN, inst->bus);
+			if (bus) {
+				if (inst->debug)
+					dev_dbg(dev, "Rescan PCI bus %02x\n",
+						inst->bus);
+				pci_lock_rescan_remove();
+				pci_rescan_bus(bus);
+				pci_unlock_rescan_remove();
+				inst->linkup_rescans++;
+			}
+		}
+		poll_ms = min(poll_ms * 2, FPGA_CFG_LINKUP_POLL_MAX_MS);
+	}
+
+	if (!inst->drv_bound) {
+		fpga_cfg_wait_del(inst);
+		inst->linkup_timeouts++;
+		dev_err(dev, "PCIe device %s link up timeout (%u ms)\n",
+			inst->bdf, inst->linkup_timeout_ms);
+		fpga_cfg_stage_end(inst, inst->load_seq_cur,
+				   FPGA_CFG_STAGE_LINKUP, start, 0, -ETIMEDOUT);
+		return -ETIMEDOUT;
+	}
+
+	fpga_cfg_stage_end(inst, inst->load_seq_cur, FPGA_CFG_STAGE_LINKUP,
+			   start, 0, 0);
+	return 0;
+}
+
+static struct shash_desc *fpga_cfg_shash_alloc(void)
+{
+	struct crypto_shash *tfm;
+	struct shash_desc *desc;
+
+	tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(tfm))
+		return ERR_CAST(tfm);
+
+	desc = kzalloc(sizeof(*desc) + crypto_shash_descsize(tfm), GFP_KERNEL);
+	if (!desc) {
+		crypto_free_shash(tfm);
+		return ERR_PTR(-ENOMEM);
+	}
+	desc->tfm = tfm;
+	return desc;
+}
+
+static void fpga_cfg_shash_free(struct shash_desc *desc)
+{
+	crypto_free_shash(desc->tfm);
+	kfree(desc);
+}
+
+static int fpga_cfg_digest(const u8 *data, size_t size, u8 *out)
+{
+	struct shash_desc *desc;
+	int ret;
+
+	desc = fpga_cfg_shash_alloc();
+	if (IS_ERR(desc))
+		return PTR_ERR(desc);
+
+	ret = crypto_shash_digest(desc, data, size, out);
+	fpga_cfg_shash_free(desc);
+	return ret;
+}
+
+/*
+ * Compressed images (.gz, .xz, .zst) are decompressed page by page into
+ * a scatter-gather table which is passed to the FPGA manager. No large
+ * contiguous buffer is needed and the compressed file is only kept in
+ * the bitstream cache, but all pages of the decompressed image are
+ * allocated before fpga_mgr_load(), so memory use still grows with the
+ * image size up to FPGA_CFG_PAGES_MAX.
+ */
+enum fpga_cfg_comp {
+	FPGA_CFG_COMP_NONE,
+	FPGA_CFG_COMP_GZ,
+	FPGA_CFG_COMP_XZ,
+	FPGA_CFG_COMP_ZST,
+};
+
+static enum fpga_cfg_comp fpga_cfg_comp_type(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len > 3 && !strcmp(name + len - 3, ".gz"))
+		return FPGA_CFG_COMP_GZ;
+	if (len > 3 && !strcmp(name + len - 3, ".xz"))
+		return FPGA_CFG_COMP_XZ;
+	if (len > 4 && !strcmp(name + len - 4, ".zst"))
+		return FPGA_CFG_COMP_ZST;
+	return FPGA_CFG_COMP_NONE;
+}
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+/*
+ * Bitstream cache. Images are kept as requested from the firmware
+ * loader and are identified by firmware name, file size and mtime,
+ * so a changed file is fetched again. Entries are refcounted, an
+ * entry evicted while in use is freed by its last user.
+ */
+struct fpga_cfg_img {
+	struct hlist_node node;
+	struct list_head lru;
+	struct kref ref;
+	bool cached;
+	char *name;
+	loff_t size;
+	s64 mtime_sec;
+	long mtime_nsec;
+	const struct firmware *fw;
+	struct mutex digest_lock;
+	bool digest_valid;
+	u8 digest[FPGA_CFG_DIGEST_SIZE];
+};
+
+#define FPGA_CFG_CACHE_BITS	5
+
+static DEFINE_MUTEX(img_cache_lock);
+static DEFINE_HASHTABLE(img_cache, FPGA_CFG_CACHE_BITS);
+static LIST_HEAD(img_cache_lru);
+static size_t img_cache_bytes;
+static unsigned long img_cache_hits;
+static unsigned long img_cache_misses;
+static unsigned long img_cache_evictions;
+
+static void fpga_cfg_img_release(struct kref *ref)
+{
+	struct fpga_cfg_img *img = container_of(ref, struct fpga_cfg_img, ref);
+
+	release_firmware(img->fw);
+	kfree(img->name);
+	kfree(img);
+}
+
+static void fpga_cfg_img_put(struct fpga_cfg_img *img)
+{
+	kref_put(&img->ref, fpga_cfg_img_release);
+}
+
+/* Drop the cache reference, called with img_cache_lock held */
+static void fpga_cfg_img_unlink(struct fpga_cfg_img *img)
+{
+	hash_del(&img->node);
+	list_del_init(&img->lru);
+	img->cached = false;
+	img_cache_bytes -= img->fw->size;
+	fpga_cfg_img_put(img);
+}
+
+/* Called with img_cache_lock held */
+static void fpga_cfg_img_evict(size_t max_bytes)
+{
+	struct fpga_cfg_img *img;
+
+	while (img_cache_bytes > max_bytes && !list_empty(&img_cache_lru)) {
+		img = list_first_entry(&img_cache_lru, struct fpga_cfg_img, lru);
+		pr_debug("fpga-cfg: evict '%s' from cache\n", img->name);
+		fpga_cfg_img_unlink(img);
+		img_cache_evictions++;
+	}
+}
+
+/* Called with img_cache_lock held */
+static struct fpga_cfg_img *fpga_cfg_img_lookup(const char *name, u32 hash)
+{
+	struct fpga_cfg_img *img;
+
+	hash_for_each_possible(img_cache, img, node, hash) {
+		if (!strcmp(img->name, name))
+			return img;
+	}
+	return NULL;
+}
+
+static bool fpga_cfg_img_match(struct fpga_cfg_img *img, struct kstat *stat)
+{
+	return img->size == stat->size &&
+	       img->mtime_sec == stat->mtime.tv_sec &&
+	       img->mtime_nsec == stat->mtime.tv_nsec;
+}
+
+/*
+ * Get the image of desc, either from the cache or via the firmware
+ * loader. Release with fpga_cfg_img_put().
+ */
+static struct fpga_cfg_img *fpga_cfg_img_get(struct device *dev,
+					     struct cfg_desc *desc)
+{
+	size_t max_bytes = READ_ONCE(fpgacfg_cache_max_bytes);
+	struct fpga_cfg_img *img, *old;
+	struct kstat stat;
+	struct path path;
+	u32 hash;
+	int ret;
+
+	ret = kern_path(desc->firmware_abs, LOOKUP_FOLLOW, &path);
+	if (ret)
+		return ERR_PTR(ret);
+	ret = vfs_getattr(&path, &stat, STATX_SIZE | STATX_MTIME,
+			  AT_STATX_SYNC_AS_STAT);
+	path_put(&path);
+	if (ret)
+		return ERR_PTR(ret);
+
+	/* large images are read into pages by fpga_cfg_read_pages() */
+	if (fpgacfg_stream_min_bytes && stat.size >= fpgacfg_stream_min_bytes &&
+	    fpga_cfg_comp_type(desc->firmware) == FPGA_CFG_COMP_NONE)
+		return ERR_PTR(-EFBIG);
+
+	hash = jhash(desc->firmware, strlen(desc->firmware), 0);
+
+	mutex_lock(&img_cache_lock);
+	img = fpga_cfg_img_lookup(desc->firmware, hash);
+	if (img) {
+		if (fpga_cfg_img_match(img, &stat)) {
+			kref_get(&img->ref);
+			list_move_tail(&img->lru, &img_cache_lru);
+			img_cache_hits++;
+			mutex_unlock(&img_cache_lock);
+			return img;
+		}
+		/* file changed on disk */
+		fpga_cfg_img_unlink(img);
+	}
+	img_cache_misses++;
+	mutex_unlock(&img_cache_lock);
+
+	img = kzalloc(sizeof(*img), GFP_KERNEL);
+	if (!img)
+		return ERR_PTR(-ENOMEM);
+
+	img->name = kstrdup(desc->firmware, GFP_KERNEL);
+	if (!img->name) {
+		kfree(img);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ret = request_firmware(&img->fw, desc->firmware, dev);
+	if (ret) {
+		kfree(img->name);
+		kfree(img);
+		return ERR_PTR(ret);
+	}
+
+	kref_init(&img->ref);
+	INIT_LIST_HEAD(&img->lru);
+	mutex_init(&img->digest_lock);
+	img->size = stat.size;
+	img->mtime_sec = stat.mtime.tv_sec;
+	img->mtime_nsec = stat.mtime.tv_nsec;
+
+	if (!max_bytes || img->fw->size > max_bytes)
+		return img;
+
+	mutex_lock(&img_cache_lock);
+	old = fpga_cfg_img_lookup(img->name, hash);
+	if (old && fpga_cfg_img_match(old, &stat)) {
+		/* fetched concurrently by another load, use that one */
+		kref_get(&old->ref);
+		mutex_unlock(&img_cache_lock);
+		fpga_cfg_img_put(img);
+		return old;
+	}
+	if (old)
+		fpga_cfg_img_unlink(old);
+
+	kref_get(&img->ref);
+	img->cached = true;
+	hash_add(img_cache, &img->node, hash);
+	list_add_tail(&img->lru, &img_cache_lru);
+	img_cache_bytes += img->fw->size;
+	fpga_cfg_img_evict(max_bytes);
+	mutex_unlock(&img_cache_lock);
+
+	return img;
+}
+
+/* The digest is computed on first use and kept with the cached image */
+static int fpga_cfg_img_digest(struct fpga_cfg_img *img, u8 *out)
+{
+	int ret = 0;
+
+	mutex_lock(&img->digest_lock);
+	if (!img->digest_valid) {
+		ret = fpga_cfg_digest(img->fw->data, img->fw->size,
+				      img->digest);
+		img->digest_valid = !ret;
+	}
+	if (!ret)
+		memcpy(out, img->digest, FPGA_CFG_DIGEST_SIZE);
+	mutex_unlock(&img->digest_lock);
+
+	return ret;
+}
+
+static void fpga_cfg_prefetch_work(struct work_struct *work)
+{
+	struct cfg_desc *desc = container_of(work, struct cfg_desc,
+					     prefetch_work);
+
+	desc->prefetch_img = fpga_cfg_img_get(desc->prefetch_dev, desc);
+}
+
+/*
+ * Start reading the image of desc in the background, the result is
+ * picked up by fpga_cfg_mgr_load(). Called with load_lock held.
+ */
+static void fpga_cfg_prefetch(struct fpga_cfg_fpga_inst *inst,
+			      struct cfg_desc *desc)
+{
+	if (!fpgacfg_prefetch || !desc->firmware[0] || desc->prefetch_queued ||
+	    desc->upload)
+		return;
+
+	desc->prefetch_dev = &inst->cfg->pdev->dev;
+	desc->prefetch_img = NULL;
+	desc->prefetch_queued = true;
+	queue_work(system_unbound_wq, &desc->prefetch_work);
+}
+
+static struct fpga_cfg_img *fpga_cfg_prefetch_take(struct cfg_desc *desc)
+{
+	struct fpga_cfg_img *img;
+
+	if (!desc->prefetch_queued)
+		return NULL;
+
+	flush_work(&desc->prefetch_work);
+	desc->prefetch_queued = false;
+	img = desc->prefetch_img;
+	desc->prefetch_img = NULL;
+
+	return IS_ERR(img) ? NULL : img;
+}
+
+static void fpga_cfg_prefetch_drop(struct cfg_desc *desc)
+{
+	struct fpga_cfg_img *img = fpga_cfg_prefetch_take(desc);
+
+	if (img)
+		fpga_cfg_img_put(img);
+}
+
+static void fpga_cfg_img_cache_flush(void)
+{
+	mutex_lock(&img_cache_lock);
+	fpga_cfg_img_evict(0);
+	mutex_unlock(&img_cache_lock);
+}
+
+#define FPGA_CFG_CACHE_BUF_SZ	SZ_16K
+
+static ssize_t fpga_cfg_cache_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_img *img;
+	size_t len = 0;
+	ssize_t ret;
+	char *tmp;
+
+	tmp = kmalloc(FPGA_CFG_CACHE_BUF_SZ, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	mutex_lock(&img_cache_lock);
+	len += scnprintf(tmp + len, FPGA_CFG_CACHE_BUF_SZ - len,
+			 "bytes: %zu\nmax_bytes: %lu\nhits: %lu\n"
+			 "misses: %lu\nevictions: %lu\n",
+			 img_cache_bytes, fpgacfg_cache_max_bytes,
+			 img_cache_hits, img_cache_misses,
+			 img_cache_evictions);
+	list_for_each_entry_reverse(img, &img_cache_lru, lru) {
+		len += scnprintf(tmp + len, FPGA_CFG_CACHE_BUF_SZ - len,
+				 "%s\t%zu\trefs %u\n", img->name,
+				 img->fw->size, kref_read(&img->ref) - 1);
+	}
+	mutex_unlock(&img_cache_lock);
+
+	ret = simple_read_from_buffer(buf, count, ppos, tmp, len);
+	kfree(tmp);
+	return ret;
+}
+
+static ssize_t fpga_cfg_cache_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	int ret, val;
+
+	ret = kstrtoint_from_user(buf, count, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val == 0)
+		fpga_cfg_img_cache_flush();
+
+	return count;
+}
+
+static const struct file_operations dbgfs_cache_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_cache_read,
+	.write = fpga_cfg_cache_write,
+	.llseek = default_llseek,
+};
+
+/* Limit for the size of an image read or decompressed into pages */
+#define FPGA_CFG_PAGES_MAX	SZ_1G
+
+struct fpga_cfg_pages {
+	struct page **pages;
+	unsigned int nr;
+	unsigned int max;
+	size_t len;
+};
+
+static void fpga_cfg_pages_free(struct fpga_cfg_pages *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < p->nr; i++)
+		__free_page(p->pages[i]);
+	kvfree(p->pages);
+	p->pages = NULL;
+	p->nr = 0;
+	p->max = 0;
+	p->len = 0;
+}
+
+/* Append a page, returns its address or NULL */
+static u8 *fpga_cfg_pages_add(struct fpga_cfg_pages *p)
+{
+	struct page **pages;
+	struct page *page;
+
+	if ((size_t)(p->nr + 1) * PAGE_SIZE > FPGA_CFG_PAGES_MAX)
+		return NULL;
+
+	if (p->nr == p->max) {
+		p->max = p->max ? p->max * 2 : 256;
+		pages = kvmalloc_array(p->max, sizeof(*pages), GFP_KERNEL);
+		if (!pages)
+			return NULL;
+		if (p->nr)
+			memcpy(pages, p->pages, p->nr * sizeof(*pages));
+		kvfree(p->pages);
+		p->pages = pages;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return NULL;
+
+	p->pages[p->nr++] = page;
+	return page_address(page);
+}
+
+/* Set up sgt for the pages, on failure the pages are freed */
+static int fpga_cfg_pages_sgt(struct fpga_cfg_pages *p, struct sg_table *sgt)
+{
+	int ret = -EINVAL;
+
+	if (p->len)
+		ret = sg_alloc_table_from_pages(sgt, p->pages, p->nr, 0,
+						p->len, GFP_KERNEL);
+	if (ret)
+		fpga_cfg_pages_free(p);
+
+	return ret;
+}
+
+/*
+ * Read the file page by page. Used for large images, which would
+ * otherwise need one buffer of the image size in the firmware loader
+ * and in the cache.
+ */
+static int fpga_cfg_read_file_pages(struct file *filp,
+				    struct fpga_cfg_pages *p)
+{
+	loff_t pos = 0;
+	size_t off;
+	ssize_t n;
+	u8 *addr;
+	int ret = 0;
+
+	do {
+		addr = fpga_cfg_pages_add(p);
+		if (!addr) {
+			ret = -ENOMEM;
+			break;
+		}
+		for (off = 0; off < PAGE_SIZE; off += n) {
+			n = kernel_read(filp, addr + off, PAGE_SIZE - off, &pos);
+			if (n <= 0)
+				break;
+		}
+		if (n < 0)
+			ret = n;
+		p->len += off;
+	} while (!ret && off == PAGE_SIZE);
+
+	/* drop the unused last page */
+	if (!ret && p->nr && !off)
+		__free_page(p->pages[--p->nr]);
+	if (ret)
+		fpga_cfg_pages_free(p);
+
+	return ret;
+}
+
+static int fpga_cfg_read_pages(const char *path, struct fpga_cfg_pages *p)
+{
+	struct file *filp;
+	int ret;
+
+	filp = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+
+	ret = fpga_cfg_read_file_pages(filp, p);
+	filp_close(filp, NULL);
+	return ret;
+}
+
+static int fpga_cfg_pages_digest(struct fpga_cfg_pages *p, u8 *out)
+{
+	struct shash_desc *desc;
+	size_t left = p->len;
+	unsigned int i;
+	int ret;
+
+	desc = fpga_cfg_shash_alloc();
+	if (IS_ERR(desc))
+		return PTR_ERR(desc);
+
+	ret = crypto_shash_init(desc);
+	for (i = 0; !ret && i < p->nr; i++) {
+		ret = crypto_shash_update(desc, page_address(p->pages[i]),
+					  min_t(size_t, left, PAGE_SIZE));
+		left -= min_t(size_t, left, PAGE_SIZE);
+	}
+	if (!ret)
+		ret = crypto_shash_final(desc, out);
+
+	fpga_cfg_shash_free(desc);
+	return ret;
+}
+
+/* Digest of a large image without reading it into memory at once */
+static int fpga_cfg_file_digest(const char *path, u8 *out)
+{
+	struct shash_desc *desc;
+	struct file *filp;
+	loff_t pos = 0;
+	ssize_t n;
+	void *buf;
+	int ret;
+
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	desc = fpga_cfg_shash_alloc();
+	if (IS_ERR(desc)) {
+		ret = PTR_ERR(desc);
+		goto out;
+	}
+
+	filp = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(filp)) {
+		ret = PTR_ERR(filp);
+		goto out_shash;
+	}
+
+	ret = crypto_shash_init(desc);
+	while (!ret) {
+		n = kernel_read(filp, buf, PAGE_SIZE, &pos);
+		if (n <= 0) {
+			ret = n;
+			break;
+		}
+		ret = crypto_shash_update(desc, buf, n);
+	}
+	if (!ret)
+		ret = crypto_shash_final(desc, out);
+
+	filp_close(filp, NULL);
+out_shash:
+	fpga_cfg_shash_free(desc);
+out:
+	kfree(buf);
+	return ret;
+}
+
+#define GZ_FHCRC	BIT(1)
+#define GZ_FEXTRA	BIT(2)
+#define GZ_FNAME	BIT(3)
+#define GZ_FCOMMENT	BIT(4)
+
+/* Returns the offset of the deflate data in a gzip file or -EINVAL */
+static int fpga_cfg_gz_header(const u8 *in, size_t len)
+{
+	size_t pos = 10;
+	u8 flags;
+
+	if (len < 18 || in[0] != 0x1f || in[1] != 0x8b || in[2] != 8)
+		return -EINVAL;
+
+	flags = in[3];
+	if (flags & GZ_FEXTRA) {
+		if (pos + 2 > len)
+			return -EINVAL;
+		pos += 2 + (in[pos] | in[pos + 1] << 8);
+	}
+	if (flags & GZ_FNAME) {
+		while (pos < len && in[pos])
+			pos++;
+		pos++;
+	}
+	if (flags & GZ_FCOMMENT) {
+		while (pos < len && in[pos])
+			pos++;
+		pos++;
+	}
+	if (flags & GZ_FHCRC)
+		pos += 2;
+
+	/* deflate data is followed by CRC32 and ISIZE */
+	if (pos + 8 > len)
+		return -EINVAL;
+
+	return pos;
+}
+
+static int fpga_cfg_gunzip(const u8 *in, size_t len, struct fpga_cfg_pages *p)
+{
+	const u8 *trailer = in + len - 8;
+	size_t off = PAGE_SIZE;
+	z_stream strm = {};
+	u32 crc = ~0;
+	u8 *out = NULL;
+	int hdr, ret;
+
+	hdr = fpga_cfg_gz_header(in, len);
+	if (hdr < 0)
+		return hdr;
+
+	strm.workspace = vmalloc(zlib_inflate_workspacesize());
+	if (!strm.workspace)
+		return -ENOMEM;
+
+	ret = zlib_inflateInit2(&strm, -MAX_WBITS);
+	if (ret != Z_OK) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	strm.next_in = in + hdr;
+	strm.avail_in = len - hdr - 8;
+
+	do {
+		if (off == PAGE_SIZE) {
+			out = fpga_cfg_pages_add(p);
+			if (!out) {
+				ret = -ENOMEM;
+				goto out_end;
+			}
+			off = 0;
+		}
+		strm.next_out = out + off;
+		strm.avail_out = PAGE_SIZE - off;
+
+		ret = zlib_inflate(&strm, Z_NO_FLUSH);
+		crc = crc32_le(crc, out + off, PAGE_SIZE - off - strm.avail_out);
+		off = PAGE_SIZE - strm.avail_out;
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			ret = -EINVAL;
+			goto out_end;
+		}
+	} while (ret != Z_STREAM_END);
+
+	p->len = (size_t)(p->nr - 1) * PAGE_SIZE + off;
+
+	if ((crc ^ ~0) != get_unaligned_le32(trailer) ||
+	    (u32)p->len != get_unaligned_le32(trailer + 4))
+		ret = -EBADMSG;
+	else
+		ret = 0;
+out_end:
+	zlib_inflateEnd(&strm);
+out:
+	vfree(strm.workspace);
+	return ret;
+}
+
+static int fpga_cfg_unxz(const u8 *in, size_t len, struct fpga_cfg_pages *p)
+{
+	struct xz_buf buf = {};
+	struct xz_dec *xz;
+	enum xz_ret xret;
+	int ret = 0;
+
+	xz = xz_dec_init(XZ_DYNALLOC, SZ_64M);
+	if (!xz)
+		return -ENOMEM;
+
+	buf.in = in;
+	buf.in_size = len;
+	buf.out_size = PAGE_SIZE;
+	buf.out_pos = PAGE_SIZE;
+
+	do {
+		if (buf.out_pos == PAGE_SIZE) {
+			buf.out = fpga_cfg_pages_add(p);
+			if (!buf.out) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			buf.out_pos = 0;
+		}
+		xret = xz_dec_run(xz, &buf);
+	} while (xret == XZ_OK);
+
+	if (xret != XZ_STREAM_END) {
+		ret = xret == XZ_MEM_ERROR ? -ENOMEM : -EINVAL;
+		goto out;
+	}
+
+	p->len = (size_t)(p->nr - 1) * PAGE_SIZE + buf.out_pos;
+out:
+	xz_dec_end(xz);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static int fpga_cfg_unzstd(const u8 *in, size_t len, struct fpga_cfg_pages *p)
+{
+	zstd_in_buffer inb = { .src = in, .size = len };
+	zstd_out_buffer outb = { .size = PAGE_SIZE, .pos = PAGE_SIZE };
+	zstd_frame_header fh;
+	zstd_dstream *ds;
+	size_t wksp_size, zret;
+	void *wksp;
+	int ret = 0;
+
+	zret = zstd_get_frame_header(&fh, in, len);
+	if (zret || fh.windowSize > SZ_64M)
+		return -EINVAL;
+
+	wksp_size = zstd_dstream_workspace_bound(fh.windowSize);
+	wksp = vmalloc(wksp_size);
+	if (!wksp)
+		return -ENOMEM;
+
+	ds = zstd_init_dstream(fh.windowSize, wksp, wksp_size);
+	if (!ds) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	do {
+		if (outb.pos == PAGE_SIZE) {
+			outb.dst = fpga_cfg_pages_add(p);
+			if (!outb.dst) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			outb.pos = 0;
+		}
+		zret = zstd_decompress_stream(ds, &outb, &inb);
+		if (zstd_is_error(zret)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		/* input consumed, but frame not complete */
+		if (zret && inb.pos == inb.size && outb.pos < PAGE_SIZE) {
+			ret = -EINVAL;
+			goto out;
+		}
+	} while (zret);
+
+	p->len = (size_t)(p->nr - 1) * PAGE_SIZE + outb.pos;
+out:
+	vfree(wksp);
+	return ret;
+}
+#else
+static int fpga_cfg_unzstd(const u8 *in, size_t len, struct fpga_cfg_pages *p)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+/*
+ * Decompress fw into pages and set up sgt for the FPGA manager. Free
+ * with sg_free_table() and fpga_cfg_pages_free().
+ */
+static int fpga_cfg_decompress(const struct firmware *fw,
+			       enum fpga_cfg_comp comp,
+			       struct fpga_cfg_pages *p, struct sg_table *sgt)
+{
+	int ret;
+
+	switch (comp) {
+	case FPGA_CFG_COMP_GZ:
+		ret = fpga_cfg_gunzip(fw->data, fw->size, p);
+		break;
+	case FPGA_CFG_COMP_XZ:
+		ret = fpga_cfg_unxz(fw->data, fw->size, p);
+		break;
+	case FPGA_CFG_COMP_ZST:
+		ret = fpga_cfg_unzstd(fw->data, fw->size, p);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+	if (ret) {
+		fpga_cfg_pages_free(p);
+		return ret;
+	}
+
+	return fpga_cfg_pages_sgt(p, sgt);
+}
+#endif
+
+/* Compute the digest of the image currently requested for desc */
+static int fpga_cfg_desc_digest(struct fpga_cfg_fpga_inst *inst,
+				struct cfg_desc *desc, u8 *out)
+{
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+	struct fpga_cfg_img *img;
+	int ret;
+
+	if (desc->upload)
+		return fpga_cfg_pages_digest(desc->upload, out);
+
+	img = fpga_cfg_img_get(&inst->cfg->pdev->dev, desc);
+	if (PTR_ERR(img) == -EFBIG)
+		return fpga_cfg_file_digest(desc->firmware_abs, out);
+	if (IS_ERR(img))
+		return PTR_ERR(img);
+
+	ret = fpga_cfg_img_digest(img, out);
+	fpga_cfg_img_put(img);
+	return ret;
+#else
+	const struct firmware *fw;
+	int ret;
+
+	ret = request_firmware(&fw, desc->firmware, &inst->cfg->pdev->dev);
+	if (ret)
+		return ret;
+
+	ret = fpga_cfg_digest(fw->data, fw->size, out);
+	release_firmware(fw);
+	return ret;
+#endif
+}
+
+/*
+ * Load the image of desc with mgr. Since v4.16 the image is taken from
+ * the bitstream cache and passed as buffer, so repeated loads of an
+ * unchanged file don't go through the firmware loader. Compressed,
+ * large and uploaded images are passed as scatter-gather table of
+ * single pages.
+ */
+static int fpga_cfg_mgr_load(struct fpga_cfg_fpga_inst *inst,
+			     struct fpga_manager *mgr,
+			     struct fpga_image_info *info,
+			     struct cfg_desc *desc)
+{
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+	enum fpga_cfg_comp comp = fpga_cfg_comp_type(desc->firmware);
+	struct device *dev = &inst->cfg->pdev->dev;
+	struct fpga_cfg_pages pages = {};
+	struct fpga_cfg_pages *sg_pages = NULL;
+	struct fpga_cfg_img *img = NULL;
+	struct sg_table sgt;
+	char *copy = NULL;
+	size_t bytes;
+	u64 start;
+	int ret;
+
+	start = fpga_cfg_stage_begin(inst, desc->load_seq,
+				     FPGA_CFG_STAGE_FETCH);
+
+	if (desc->upload) {
+		sg_pages = desc->upload;
+		ret = sg_alloc_table_from_pages(&sgt, sg_pages->pages,
+						sg_pages->nr, 0, sg_pages->len,
+						GFP_KERNEL);
+		if (ret)
+			goto err_fetch;
+		goto load;
+	}
+
+	img = fpga_cfg_prefetch_take(desc);
+	if (!img)
+		img = fpga_cfg_img_get(dev, desc);
+	if (PTR_ERR(img) == -EFBIG) {
+		img = NULL;
+		ret = fpga_cfg_read_pages(desc->firmware_abs, &pages);
+		if (!ret)
+			ret = fpga_cfg_pages_sgt(&pages, &sgt);
+		if (ret) {
+			dev_err(dev, "Failed to read '%s': %d\n",
+				desc->firmware_abs, ret);
+			goto err_fetch;
+		}
+		sg_pages = &pages;
+		if (inst->debug)
+			dev_dbg(dev, "'%s': %zu bytes in %u pages\n",
+				desc->firmware, pages.len, pages.nr);
+	} else if (IS_ERR(img)) {
+		ret = PTR_ERR(img);
+		goto err_fetch;
+	} else if (comp != FPGA_CFG_COMP_NONE) {
+		ret = fpga_cfg_decompress(img->fw, comp, &pages, &sgt);
+		if (ret) {
+			dev_err(dev, "Failed to decompress '%s': %d\n",
+				desc->firmware, ret);
+			fpga_cfg_img_put(img);
+			goto err_fetch;
+		}
+		sg_pages = &pages;
+		if (inst->debug)
+			dev_dbg(dev, "'%s': %zu bytes decompressed\n",
+				desc->firmware, pages.len);
+	} else {
+		info->buf = (const char *)img->fw->data;
+		info->count = img->fw->size;
+
+		/* altera-ps-spi reverses the bit order in the passed buffer */
+		if (desc == &inst->spi && inst->mgr_type == SPI_RING_MGR) {
+			copy = vmalloc(img->fw->size);
+			if (!copy) {
+				fpga_cfg_img_put(img);
+				ret = -ENOMEM;
+				goto err_fetch;
+			}
+			memcpy(copy, img->fw->data, img->fw->size);
+			info->buf = copy;
+		}
+	}
+
+load:
+	bytes = sg_pages ? sg_pages->len : info->count;
+	fpga_cfg_stage_end(inst, desc->load_seq, FPGA_CFG_STAGE_FETCH, start,
+			   bytes, 0);
+	desc->digest_valid = false;
+	if (sg_pages) {
+		/* the manager may modify the pages, hash them before */
+		if (!img && inst->load_if_changed)
+			desc->digest_valid = !fpga_cfg_pages_digest(sg_pages,
+								    desc->digest);
+		info->buf = NULL;
+		info->count = 0;
+		info->sgt = &sgt;
+	}
+
+	fpga_cfg_progress_rate(inst, &desc->tput);
+	start = fpga_cfg_stage_begin(inst, desc->load_seq,
+				     FPGA_CFG_STAGE_WRITE);
+	ret = fpga_mgr_load(mgr, info);
+	fpga_cfg_stage_end(inst, desc->load_seq, FPGA_CFG_STAGE_WRITE, start,
+			   bytes, ret);
+	if (!ret) {
+		fpga_cfg_tput_add(&desc->tput, bytes, local_clock() - start);
+		fpga_cfg_progress_rate(inst, &desc->tput);
+	}
+
+	if (img && !ret && inst->load_if_changed)
+		desc->digest_valid = !fpga_cfg_img_digest(img, desc->digest);
+	else if (ret)
+		desc->digest_valid = false;
+
+	if (sg_pages) {
+		info->sgt = NULL;
+		sg_free_table(&sgt);
+		if (sg_pages == &pages)
+			fpga_cfg_pages_free(&pages);
+	}
+	vfree(copy);
+	if (img)
+		fpga_cfg_img_put(img);
+	return ret;
+
+err_fetch:
+	fpga_cfg_stage_end(inst, desc->load_seq, FPGA_CFG_STAGE_FETCH, start,
+			   0, ret);
+	return ret;
+#else
+	u64 start;
+	int ret;
+
+	if (fpga_cfg_comp_type(desc->firmware) != FPGA_CFG_COMP_NONE) {
+		dev_err(&inst->cfg->pdev->dev,
+			"Compressed images need fpga_mgr_load() support\n");
+		return -EOPNOTSUPP;
+	}
+
+	desc->digest_valid = false;
+	/* the firmware is fetched by the manager, timed as write */
+	start = fpga_cfg_stage_begin(inst, desc->load_seq,
+				     FPGA_CFG_STAGE_WRITE);
+	ret = fpga_mgr_firmware_load(mgr, info, desc->firmware);
+	fpga_cfg_stage_end(inst, desc->load_seq, FPGA_CFG_STAGE_WRITE, start,
+			   0, ret);
+	if (!ret && inst->load_if_changed)
+		desc->digest_valid = !fpga_cfg_desc_digest(inst, desc,
+							   desc->digest);
+	return ret;
+#endif
+}
+
+/*
+ * Check if the image requested for desc has the content loaded last.
+ * Called with load_lock or, for a PR region, the region lock held.
+ */
+static bool fpga_cfg_desc_unchanged(struct fpga_cfg_fpga_inst *inst,
+				    struct cfg_desc *desc)
+{
+	u8 digest[FPGA_CFG_DIGEST_SIZE];
+
+	if (!desc->digest_valid || !desc->firmware[0])
+		return false;
+
+	if (fpga_cfg_desc_digest(inst, desc, digest))
+		return false;
+
+	return !memcmp(digest, desc->digest, FPGA_CFG_DIGEST_SIZE);
+}
+
+/* Check if pdev is there and bound to a driver, drops the reference */
+static bool fpga_cfg_pci_bound(struct pci_dev *pdev)
+{
+	bool bound;
+
+	if (!pdev)
+		return false;
+	bound = pdev->driver != NULL;
+	pci_dev_put(pdev);
+	return bound;
+}
+
+/*
+ * Check if a load of the current description can be skipped: the
+ * previous configuration succeeded, all requested images are unchanged
+ * and the PCIe FPGA device is still there and bound to a driver.
+ * Called after fpga_cfg_req_apply(), PR loads use fpga_cfg_pr_unchanged().
+ */
+static bool fpga_cfg_unchanged(struct fpga_cfg_fpga_inst *inst)
+{
+	struct cfg_desc *desc;
+
+	if (!atomic_read(&inst->cfg_done))
+		return false;
+
+	switch (inst->cfg_op1) {
+	case FPP_RING_MGR:
+	case SPI_RING_MGR:
+		desc = inst->fpp.mgr ? &inst->fpp : &inst->spi;
+		if (!fpga_cfg_desc_unchanged(inst, desc))
+			return false;
+		if (inst->cfg_op2 == CVP_MGR &&
+		    !fpga_cfg_desc_unchanged(inst, &inst->cvp))
+			return false;
+		break;
+	case SPI_MGR:
+		return fpga_cfg_desc_unchanged(inst, &inst->spi);
+	default:
+		return false;
+	}
+
+	return fpga_cfg_pci_bound(fpga_cfg_find_cvp_dev(inst));
+}
+
+/* Same for the PR load of region r, called with r->lock held */
+static bool fpga_cfg_pr_unchanged(struct fpga_cfg_fpga_inst *inst,
+				  struct fpga_cfg_pr_region *r)
+{
+	if (!r->cfg_done || !fpga_cfg_desc_unchanged(inst, &r->desc))
+		return false;
+
+	return fpga_cfg_pci_bound(fpga_cfg_find_pci_dev(inst, r->bus, r->dev,
+							r->func, r->bdf));
+}
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(4, 15, 9)
+static inline void fpga_cfg_prefetch(struct fpga_cfg_fpga_inst *inst,
+				     struct cfg_desc *desc)
+{
+}
+
+static inline void fpga_cfg_prefetch_drop(struct cfg_desc *desc)
+{
+}
+#endif
+
+static inline bool inst_is_fpp(struct fpga_cfg_fpga_inst *inst)
+{
+	if (inst->cfg_op1 == FPP_RING_MGR)
+		return true;
+	return false;
+}
+
+static int fpga_cfg_do_cvp(struct fpga_cfg_fpga_inst *inst)
+{
+	struct pci_bus __maybe_unused *bus;
+	struct fpga_manager *mgr;
+	struct pci_dev *pdev;
+	struct device *dev;
+	struct fpga_image_info info;
+	u64 seq = inst->load_seq_cur;
+	bool modprobe;
+	u64 start;
+	int ret;
+
+	dev = &inst->cfg->pdev->dev;
+
+	memset(&info, 0, sizeof(info));
+	atomic_set(&inst->cfg_done, 0);
+	inst->driver_to_bind = NULL;
+
+	pdev = inst->pci_dev;
+	if (!pdev) {
+		pdev = fpga_cfg_find_cvp_dev(inst);
+		if (!pdev) {
+			dev_dbg(dev, "PCIe FPGA dev for CvP not found.\n");
+			return -ENODEV;
+		}
+	}
+
+	inst->cvp.mgr_dev = &pdev->dev;
+
+	mgr = fpga_mgr_get(&pdev->dev);
+	if (IS_ERR(mgr)) {
+		ret = PTR_ERR(mgr);
+		dev_err(dev, "failed getting CvP manager: %d\n", ret);
+		return ret;
+	}
+	if (inst->debug) {
+		dev_info(dev, "CvP cfg step start\n");
+		dev_info(dev, "Using CvP manager: '%s'\n", mgr->name);
+	}
+
+	/*
+	 * Run modprobe only if the mfd driver isn't registered yet, and
+	 * overlapped with the CvP write.
+	 */
+	inst->modprobe_ret = 0;
+	inst->modprobe_ns = 0;
+	modprobe = !driver_find(inst->fpga_drv, &pci_bus_type);
+	if (modprobe) {
+		trace_fpga_cfg_stage_start(inst->cfg->dir_buf, seq,
+			fpga_cfg_stage_str[FPGA_CFG_STAGE_MODPROBE], 0, 0);
+		queue_work(system_unbound_wq, &inst->modprobe_work);
+	} else if (inst->debug) {
+		dev_dbg(dev, "Driver '%s' registered, skip modprobe\n",
+			inst->fpga_drv);
+	}
+
+	inst->cvp.mgr = mgr;
+	start = fpga_cfg_stage_begin(inst, seq, FPGA_CFG_STAGE_CVP);
+	ret = fpga_cfg_mgr_load(inst, inst->cvp.mgr, &info, &inst->cvp);
+	fpga_cfg_stage_end(inst, seq, FPGA_CFG_STAGE_CVP, start, 0, ret);
+	if (ret < 0) {
+		fpga_mgr_put(mgr);
+		inst->cvp.mgr = NULL;
+		goto err;
+	}
+	atomic_set(&inst->cfg_done, 1);
+	fpga_cfg_op_log(inst, &inst->cvp);
+	fpga_mgr_put(mgr);
+	inst->cvp.mgr = NULL;
+	if (inst->debug)
+		dev_info(dev, "CvP cfg step done\n");
+
+#if 0
+		/* Shouldn't be needed with working hotplug */
+		if (pdev->vendor == 0x1172 &&
+		    (pdev->device == 0xe003 || pdev->device == 0xe001)) {
+			if (inst->debug)
+				dev_dbg(dev, "Reattach CvP device\n");
+			bus = pdev->bus;
+			/* Unbind and remove the PCIe FPGA device first */
+			pci_lock_rescan_remove();
+			pci_dev_get(pdev);
+			pci_stop_and_remove_bus_device(pdev);
+			pci_dev_put(pdev);
+			pci_unlock_rescan_remove();
+
+			if (inst->debug)
+				dev_dbg(dev, "PCI bus rescan\n");
+			pci_bus_rescan(inst, bus, inst->fpga_drv);
+			if (inst->debug) {
+				dev_dbg(dev, "PCI bus rescan done\n");
+				dev_dbg(dev, "CvP device reattach done\n");
+			}
+		} else
+#endif
+	{
+		/* Detach CvP driver and bind to mfd driver */
+		pci_device_driver_unbind(&pdev->dev);
+
+		/* Wait for the fpga driver module load, if started */
+		flush_work(&inst->modprobe_work);
+		if (modprobe) {
+			trace_fpga_cfg_stage_end(inst->cfg->dir_buf, seq,
+				fpga_cfg_stage_str[FPGA_CFG_STAGE_MODPROBE], 0,
+				inst->modprobe_ret);
+			fpga_cfg_genl_stage_end(inst, seq,
+						FPGA_CFG_STAGE_MODPROBE,
+						inst->modprobe_ns, 0,
+						inst->modprobe_ret);
+		}
+		if (inst->modprobe_ret)
+			dev_warn(dev, "Failed to load module '%s %s': err %d\n",
+				 inst->fpga_drv, inst->fpga_drv_args,
+				 inst->modprobe_ret);
+		else if (modprobe)
+			fpga_cfg_lat_add(&inst->stage_lat[FPGA_CFG_STAGE_MODPROBE],
+					 inst->modprobe_ns);
+
+		inst->driver_to_bind = inst->fpga_drv;
+		fpga_cfg_wait_add(inst);
+		start = fpga_cfg_stage_begin(inst, seq, FPGA_CFG_STAGE_BIND);
+		ret = pci_device_driver_bind(pdev, inst, inst->fpga_drv);
+		fpga_cfg_stage_end(inst, seq, FPGA_CFG_STAGE_BIND, start, 0, ret);
+		if (ret)
+			dev_err(dev, "PCIe dev bind error %d\n", ret);
+	}
+	return 0;
+err:
+	flush_work(&inst->modprobe_work);
+	if (modprobe) {
+		trace_fpga_cfg_stage_end(inst->cfg->dir_buf, seq,
+			fpga_cfg_stage_str[FPGA_CFG_STAGE_MODPROBE], 0,
+			inst->modprobe_ret);
+		fpga_cfg_genl_stage_end(inst, seq, FPGA_CFG_STAGE_MODPROBE,
+					inst->modprobe_ns, 0,
+					inst->modprobe_ret);
+	}
+	return ret;
+}
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+struct fpga_cfg_pr_match {
+	struct device *parent;
+	unsigned int n;
+};
+
+/*
+ * Match the managers below the PCI device, PR managers registered by
+ * an mfd cell have the cell as parent
+ */
+static int fpga_cfg_pr_mgr_match(struct device *dev, const void *data)
+{
+	struct fpga_cfg_pr_match *m = (struct fpga_cfg_pr_match *)data;
+	struct device *p;
+
+	for (p = dev->parent; p; p = p->parent) {
+		if (p == m->parent)
+			return m->n-- == 0;
+	}
+	return 0;
+}
+
+/* N-th FPGA manager below a device, with a device reference */
+static struct fpga_manager *fpga_cfg_pr_mgr_find(struct device *parent,
+						 unsigned int n)
+{
+	struct fpga_cfg_pr_match m = { .parent = parent, .n = n };
+	struct device *dev;
+
+	if (!fpga_mgr_class)
+		return ERR_PTR(-ENODEV);
+
+	dev = class_find_device(fpga_mgr_class, NULL, &m,
+				fpga_cfg_pr_mgr_match);
+	if (!dev)
+		return ERR_PTR(-ENODEV);
+	return to_fpga_manager(dev);
+}
+
+/*
+ * Reference a cached manager for one load like fpga_mgr_get() does, the
+ * module reference is taken from the driver of the manager's parent.
+ * Called with pr_cache_lock held: the mfd cells are unbound only after
+ * the unbind notification of the PCI device dropped the cached handles.
+ */
+static int fpga_cfg_pr_mgr_hold(struct fpga_manager *mgr,
+				struct module **owner)
+{
+	struct device_driver *drv = mgr->dev.parent->driver;
+
+	if (!drv || !try_module_get(drv->owner))
+		return -ENODEV;
+	get_device(&mgr->dev);
+	*owner = drv->owner;
+	return 0;
+}
+
+static void fpga_cfg_pr_mgr_release(struct fpga_manager *mgr,
+				    struct module *owner)
+{
+	module_put(owner);
+	put_device(&mgr->dev);
+}
+#else
+/*
+ * fpga_mgr_get() is exclusive here, only the first region is supported
+ * and its manager must be registered for the PCI device itself. The
+ * cache keeps a device reference, each load gets the manager again.
+ */
+static struct fpga_manager *fpga_cfg_pr_mgr_find(struct device *parent,
+						 unsigned int n)
+{
+	struct fpga_manager *mgr;
+
+	if (n)
+		return ERR_PTR(-EOPNOTSUPP);
+	mgr = fpga_mgr_get(parent);
+	if (IS_ERR(mgr))
+		return mgr;
+	get_device(&mgr->dev);
+	fpga_mgr_put(mgr);
+	return mgr;
+}
+
+static int fpga_cfg_pr_mgr_hold(struct fpga_manager *mgr,
+				struct module **owner)
+{
+	struct fpga_manager *cur;
+
+	cur = fpga_mgr_get(mgr->dev.parent);
+	if (IS_ERR(cur))
+		return PTR_ERR(cur);
+	if (cur != mgr) {
+		fpga_mgr_put(cur);
+		return -ENODEV;
+	}
+	*owner = NULL;
+	return 0;
+}
+
+static void fpga_cfg_pr_mgr_release(struct fpga_manager *mgr,
+				    struct module *owner)
+{
+	fpga_mgr_put(mgr);
+}
+#endif
+
+/*
+ * PR manager of a region for a PR load, released by the caller with
+ * fpga_cfg_pr_mgr_release(). The manager and the PCI device are only
+ * looked up if no handles are cached since the last unbind of the
+ * mfd driver.
+ */
+static struct fpga_manager *fpga_cfg_pr_mgr_get(struct fpga_cfg_fpga_inst *inst,
+						struct fpga_cfg_pr_region *r,
+						struct module **owner)
+{
+	struct fpga_manager *mgr;
+	struct pci_dev *pdev;
+	int ret;
+
+	mutex_lock(&pr_cache_lock);
+	/* the description of this load may name another device */
+	if (r->desc.mgr && (r->pdev->bus->number != r->bus ||
+			    r->pdev->devfn != PCI_DEVFN(r->dev, r->func)))
+		fpga_cfg_pr_drop(r);
+	if (!r->desc.mgr) {
+		pdev = fpga_cfg_find_pci_dev(inst, r->bus, r->dev, r->func,
+					     r->bdf);
+		if (!pdev) {
+			mgr = ERR_PTR(-ENODEV);
+			goto out;
+		}
+		/* without a bound driver no unbind would drop the handles */
+		if (!pdev->driver) {
+			pci_dev_put(pdev);
+			mgr = ERR_PTR(-ENODEV);
+			goto out;
+		}
+		mgr = fpga_cfg_pr_mgr_find(&pdev->dev, r->idx);
+		if (IS_ERR(mgr)) {
+			pci_dev_put(pdev);
+			goto out;
+		}
+		r->desc.mgr = mgr;
+		r->pdev = pdev;
+		r->cache_key = FPGA_CFG_PCI_KEY(pci_domain_nr(pdev->bus),
+						pdev->bus->number,
+						pdev->devfn);
+		r->lookups++;
+		mutex_lock(&pci_wait_lock);
+		hash_add(pr_cache, &r->cache_node, r->cache_key);
+		mutex_unlock(&pci_wait_lock);
+	}
+	mgr = r->desc.mgr;
+	ret = fpga_cfg_pr_mgr_hold(mgr, owner);
+	if (ret) {
+		/* the manager went away without an unbind of the device */
+		if (ret == -ENODEV)
+			fpga_cfg_pr_drop(r);
+		mgr = ERR_PTR(ret);
+	}
+out:
+	mutex_unlock(&pr_cache_lock);
+	return mgr;
+}
+
+static const struct attribute_group *fpga_cfg_pr_groups[FPGA_CFG_PR_REGIONS];
+
+static struct fpga_cfg_pr_region *fpga_cfg_pr_region_alloc(struct fpga_cfg_fpga_inst *inst,
+							   unsigned int idx)
+{
+	struct fpga_cfg_pr_region *r;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return NULL;
+
+	r->inst = inst;
+	r->idx = idx;
+	mutex_init(&r->lock);
+	spin_lock_init(&r->lat.lock);
+	spin_lock_init(&r->desc.tput.lock);
+	INIT_HLIST_NODE(&r->cache_node);
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+	INIT_WORK(&r->desc.prefetch_work, fpga_cfg_prefetch_work);
+#endif
+	return r;
+}
+
+/*
+ * Region for a load, regions other than the first one are allocated
+ * and get their sysfs group pr<N> on the first load.
+ */
+static struct fpga_cfg_pr_region *fpga_cfg_pr_region_get(struct fpga_cfg_fpga_inst *inst,
+							 unsigned int idx)
+{
+	struct fpga_cfg_pr_region *r;
+	int ret;
+
+	mutex_lock(&inst->pr_regions_lock);
+	r = inst->pr_regions[idx];
+	if (r)
+		goto out;
+
+	r = fpga_cfg_pr_region_alloc(inst, idx);
+	if (!r) {
+		r = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	if (inst->fpp.mgr) {
+		ret = sysfs_create_group(&inst->kobj_fpga_dir,
+					 fpga_cfg_pr_groups[idx]);
+		if (ret)
+			dev_warn(&inst->cfg->pdev->dev,
+				 "Can't add pr%u group\n", idx);
+		else
+			r->sysfs = true;
+	}
+	inst->pr_regions[idx] = r;
+out:
+	mutex_unlock(&inst->pr_regions_lock);
+	return r;
+}
+
+/* Called on remove, after the jobs are done and the pr group is gone */
+static void fpga_cfg_pr_regions_free(struct fpga_cfg_fpga_inst *inst)
+{
+	struct fpga_cfg_pr_region *r;
+	int i;
+
+	mutex_lock(&inst->pr_regions_lock);
+	for (i = 0; i < FPGA_CFG_PR_REGIONS; i++) {
+		r = inst->pr_regions[i];
+		if (!r)
+			continue;
+		mutex_lock(&pr_cache_lock);
+		fpga_cfg_pr_drop(r);
+		mutex_unlock(&pr_cache_lock);
+		if (r->sysfs)
+			sysfs_remove_group(&inst->kobj_fpga_dir,
+					   fpga_cfg_pr_groups[i]);
+		inst->pr_regions[i] = NULL;
+		kfree(r);
+	}
+	mutex_unlock(&inst->pr_regions_lock);
+}
+
+static void fpga_cfg_apply_image(struct cfg_desc *desc,
+				 struct cfg_image *img,
+				 bool firmware, bool metadata)
+{
+	if (firmware) {
+		strncpy(desc->firmware, img->firmware,
+			sizeof(desc->firmware));
+		strncpy(desc->firmware_abs, img->firmware_abs,
+			sizeof(desc->firmware_abs));
+	}
+	if (metadata)
+		strncpy(desc->metadata_abs, img->metadata_abs,
+			sizeof(desc->metadata_abs));
+}
+
+/*
+ * Copy the parsed description to the instance. Keys missing in the
+ * description keep their values from previous loads, as before.
+ * The PR image is copied to its region by the caller.
+ * Called with load_lock held.
+ */
+static void fpga_cfg_req_apply(struct fpga_cfg_fpga_inst *inst,
+			       struct fpga_cfg_req *req)
+{
+	u32 keys = req->keys;
+
+	inst->cfg_op1 = req->cfg_op1;
+	inst->cfg_op2 = req->cfg_op2;
+	inst->bs_lsb_first = req->bs_lsb_first;
+	strncpy(inst->fpga_drv, req->fpga_drv, sizeof(inst->fpga_drv));
+	strncpy(inst->fpga_drv_args, req->fpga_drv_args,
+		sizeof(inst->fpga_drv_args));
+
+	if (keys & BIT(CFG_BUS_NR)) {
+		inst->bus = req->bus;
+		inst->dev = req->dev;
+		inst->func = req->func;
+		strncpy(inst->bdf, req->bdf, sizeof(inst->bdf));
+	}
+	if (keys & BIT(CFG_TYPE))
+		strncpy(inst->type, req->type, sizeof(inst->type));
+
+	fpga_cfg_apply_image(&inst->fpp, &req->fpp, keys & BIT(FPP_RING_MGR),
+			     keys & BIT(FPP_META));
+	fpga_cfg_apply_image(&inst->spi, &req->spi, keys & BIT(SPI_RING_MGR),
+			     keys & BIT(SPI_META));
+	fpga_cfg_apply_image(&inst->cvp, &req->cvp, keys & BIT(CVP_MGR),
+			     keys & BIT(CVP_META));
+
+	switch (req->upload ? req->upload_type : NOP_MGR) {
+	case FPP_RING_MGR:
+		inst->fpp.upload = req->upload;
+		break;
+	case SPI_RING_MGR:
+		inst->spi.upload = req->upload;
+		break;
+	case CVP_MGR:
+		inst->cvp.upload = req->upload;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Find or create the bus group called name, the caller holds a user */
+static struct fpga_cfg_bus_group *fpga_cfg_bus_group_get(const char *name)
+{
+	struct fpga_cfg_bus_group *grp;
+
+	mutex_lock(&bus_groups_lock);
+	list_for_each_entry(grp, &bus_groups, list) {
+		if (!strcmp(grp->name, name))
+			goto out;
+	}
+
+	grp = kzalloc(sizeof(*grp), GFP_KERNEL);
+	if (!grp) {
+		mutex_unlock(&bus_groups_lock);
+		return NULL;
+	}
+	strscpy(grp->name, name, sizeof(grp->name));
+	spin_lock_init(&grp->lock);
+	init_waitqueue_head(&grp->wq);
+	list_add_tail(&grp->list, &bus_groups);
+out:
+	grp->users++;
+	mutex_unlock(&bus_groups_lock);
+	return grp;
+}
+
+static void fpga_cfg_bus_group_put(struct fpga_cfg_bus_group *grp)
+{
+	if (!grp)
+		return;
+
+	mutex_lock(&bus_groups_lock);
+	if (!--grp->users) {
+		list_del(&grp->list);
+		kfree(grp);
+	}
+	mutex_unlock(&bus_groups_lock);
+}
+
+static bool fpga_cfg_bus_group_try(struct fpga_cfg_bus_group *grp)
+{
+	unsigned int max = READ_ONCE(fpgacfg_bus_jobs);
+	bool ok;
+
+	spin_lock(&grp->lock);
+	ok = !max || grp->running < max;
+	if (ok)
+		grp->running++;
+	spin_unlock(&grp->lock);
+	return ok;
+}
+
+/* Wait for a free write slot on the USB bus/SPI controller of inst */
+static int fpga_cfg_bus_group_enter(struct fpga_cfg_fpga_inst *inst)
+{
+	struct fpga_cfg_bus_group *grp = inst->bus_grp;
+
+	if (!grp)
+		return 0;
+	return wait_event_killable(grp->wq, fpga_cfg_bus_group_try(grp));
+}
+
+static void fpga_cfg_bus_group_leave(struct fpga_cfg_fpga_inst *inst)
+{
+	struct fpga_cfg_bus_group *grp = inst->bus_grp;
+
+	if (!grp)
+		return;
+
+	spin_lock(&grp->lock);
+	grp->running--;
+	spin_unlock(&grp->lock);
+	wake_up(&grp->wq);
+}
+
+/*
+ * Write an image through the FPP/SPI manager. Only the write uses the
+ * shared USB bus or SPI controller, so only it takes a slot of the bus
+ * group, the PCIe stages of the load run without one.
+ */
+static int fpga_cfg_bus_mgr_load(struct fpga_cfg_fpga_inst *inst,
+				 struct fpga_manager *mgr,
+				 struct fpga_image_info *info,
+				 struct cfg_desc *desc)
+{
+	int ret;
+
+	ret = fpga_cfg_bus_group_enter(inst);
+	if (ret)
+		return ret;
+	ret = fpga_cfg_mgr_load(inst, mgr, info, desc);
+	fpga_cfg_bus_group_leave(inst);
+	return ret;
+}
+
+/*
+ * Run the configuration described by req, except PR loads. Called with
+ * load_lock and pr_sem held by fpga_cfg_run().
+ */
+static int fpga_cfg_load(struct fpga_cfg_fpga_inst *inst,
+			 struct fpga_cfg_req *req)
+{
+	struct fpga_cfg_pr_region *r = NULL;
+	struct cfg_desc *desc;
+	struct pci_dev *pdev;
+	struct pci_bus __maybe_unused *bus;
+	struct device *dev;
+	struct fpga_image_info info;
+	u64 start;
+	int i, ret;
+
+	dev = &inst->cfg->pdev->dev;
+
+	memset(&info, 0, sizeof(info));
+	fpga_cfg_req_apply(inst, req);
+
+	/* PR image given with a ring image, prefetched below */
+	if (req->keys & BIT(PR_MGR)) {
+		r = fpga_cfg_pr_region_get(inst, req->pr_region);
+		if (IS_ERR(r))
+			return PTR_ERR(r);
+		fpga_cfg_apply_image(&r->desc, &req->pr, true,
+				     req->keys & BIT(PR_META));
+	}
+
+	if (inst->load_if_changed && fpga_cfg_unchanged(inst)) {
+		if (inst->debug)
+			dev_info(dev, "Images unchanged, skip configuration\n");
+		sysfs_notify(&inst->kobj_fpga_dir, NULL, "status");
+		return 0;
+	}
+	atomic_set(&inst->cfg_done, 0);
+
+	if (inst->debug)
+		dev_dbg(dev, "MGRs: %p %p %p\n",
+			inst->fpp.mgr, inst->spi.mgr, inst->cvp.mgr);
+
+	if (!inst->history_header) {
+		fpga_cfg_history_header(inst);
+		fpga_cfg_update_hist_attr(inst);
+	}
+
+	if (inst->cfg_op1 == FPP_RING_MGR || inst->cfg_op1 == SPI_RING_MGR) {
+
+		if (inst->fpp.mgr) {
+			desc = &inst->fpp;
+		} else if (inst->spi.mgr) {
+			desc = &inst->spi;
+		} else
+			return -ENODEV;
+
+		/*
+		 * Read the core image (and a PR image given in the same
+		 * description into the cache) while the ring is loaded.
+		 */
+		if (inst->cfg_op2 == CVP_MGR)
+			fpga_cfg_prefetch(inst, &inst->cvp);
+		if (r && fpgacfg_cache_max_bytes)
+			fpga_cfg_prefetch(inst, &r->desc);
+
+		/* the PR regions are reset with the ring image */
+		for (i = 0; i < FPGA_CFG_PR_REGIONS; i++) {
+			if (inst->pr_regions[i])
+				inst->pr_regions[i]->desc.digest_valid = false;
+		}
+
+		pdev = fpga_cfg_find_cvp_dev(inst);
+		if (pdev) {
+			if (pdev->driver) {
+				/* Unbind driver from FPGA device first */
+				fpga_cfg_wait_add(inst);
+				start = fpga_cfg_stage_begin(inst,
+						inst->load_seq_cur,
+						FPGA_CFG_STAGE_UNBIND);
+				pci_device_driver_unbind(&pdev->dev);
+
+				ret = wait_event_timeout(inst->wq_unbind,
+						!pdev->driver,
+						msecs_to_jiffies(inst->unbind_timeout_ms));
+				fpga_cfg_stage_end(inst, inst->load_seq_cur,
+						   FPGA_CFG_STAGE_UNBIND, start,
+						   0, ret ? 0 : -ETIMEDOUT);
+				if (!ret) {
+					dev_warn(dev, "PCI device unbind timeout\n");
+					fpga_cfg_wait_del(inst);
+				}
+			}
+		} else {
+			if (inst->debug)
+				dev_dbg(dev,
+					"No FPGA yet. Loading periph. image\n");
+		}
+		/* the device goes away with the ring load, drop the lookup ref */
+		pci_dev_put(pdev);
+
+		/*
+		 * There is no FPGA user anymore, now we can start loading
+		 * the periph. image implementing PCIe CvP device.
+		 */
+		inst->pci_dev = NULL;
+		inst->drv_bound = false;
+		if (inst->cfg_op2 == CVP_MGR)
+			inst->driver_to_bind = "altera-cvp";
+		else
+			inst->driver_to_bind = inst->fpga_drv;
+
+		fpga_cfg_wait_add(inst);
+
+		if (inst->cfg_op1 == SPI_RING_MGR) {
+			if (inst->bs_lsb_first)
+				info.flags = FPGA_MGR_BITSTREAM_LSB_FIRST;
+			else
+				info.flags &= ~FPGA_MGR_BITSTREAM_LSB_FIRST;
+		}
+
+		if (inst->debug)
+			dev_dbg(dev, "%s cfg step start\n",
+				inst_is_fpp(inst) ? "FPP" : "SPI");
+
+		/* Load ring image now */
+		ret = fpga_cfg_bus_mgr_load(inst, desc->mgr, &info, desc);
+		if (ret < 0) {
+			dev_warn(dev, "%s fpga_mgr failed: %d\n",
+				 inst_is_fpp(inst) ? "FPP" : "SPI", ret);
+			fpga_cfg_wait_del(inst);
+			goto err;
+		}
+
+		if (inst->debug) {
+			dev_dbg(dev, "%s cfg step done\n",
+				inst_is_fpp(inst) ? "FPP" : "SPI");
+
+		}
+
+		atomic_set(&inst->cfg_done, 1);
+		fpga_cfg_op_log(inst, desc);
+
+		if (inst->debug)
+			dev_dbg(dev, "Waiting for PCIe device hotplug\n");
+
+		ret = fpga_cfg_wait_linkup(inst);
+		if (ret)
+			goto err;
+		if (inst->debug)
+			dev_dbg(dev, "PCIe FPGA %s, driver bound: '%s'\n",
+				dev_name(&inst->pci_dev->dev),
+				inst->pci_dev->driver->name);
+	}
+
+	if (inst->cfg_op1 == SPI_MGR) {
+		desc = &inst->spi;
+		if (inst->debug)
+			dev_dbg(dev, "SPI cfg step start\n");
+		ret = fpga_cfg_bus_mgr_load(inst, desc->mgr, &info, desc);
+		if (ret < 0) {
+			dev_warn(dev, "SPI fpga_mgr failed: %d\n", ret);
+			goto err;
+		}
+
+		atomic_set(&inst->cfg_done, 1);
+		fpga_cfg_op_log(inst, desc);
+		if (inst->debug)
+			dev_dbg(dev, "SPI cfg step done\n");
+		sysfs_notify(&inst->kobj_fpga_dir, NULL, "status");
+		return 0;
+	}
+
+	/* Run CvP configuration if requested */
+	if (inst->cfg_op2 == CVP_MGR) {
+		ret = fpga_cfg_do_cvp(inst);
+		if (ret < 0)
+			goto err;
+	}
+
+	if (r)
+		fpga_cfg_prefetch_drop(&r->desc);
+	sysfs_notify(&inst->kobj_fpga_dir, NULL, "status");
+
+	return 0;
+
+err:
+	fpga_cfg_prefetch_drop(&inst->cvp);
+	if (r)
+		fpga_cfg_prefetch_drop(&r->desc);
+	return ret;
+}
+
+/*
+ * Run a PR load. The instance state is updated under load_lock, the
+ * load itself only holds pr_sem for read and the region lock, so loads
+ * to different regions run concurrently.
+ */
+static int fpga_cfg_pr_load(struct fpga_cfg_fpga_inst *inst,
+			    struct fpga_cfg_req *req, u64 seq, u64 load_start)
+{
+	struct device *dev = &inst->cfg->pdev->dev;
+	struct fpga_cfg_pr_region *r;
+	struct fpga_image_info info;
+	struct fpga_manager *mgr;
+	struct module *owner;
+	char bdf[sizeof(inst->bdf)];
+	int bus, slot, func;
+	u64 start;
+	int ret;
+
+	r = fpga_cfg_pr_region_get(inst, req->pr_region);
+	if (IS_ERR(r)) {
+		fpga_cfg_genl_load_end(inst, seq, PTR_ERR(r),
+				       local_clock() - load_start, NULL, NULL,
+				       req->pr_region);
+		return PTR_ERR(r);
+	}
+
+	memset(&info, 0, sizeof(info));
+
+	/*
+	 * Only the device and type keys are kept for following loads, the
+	 * ring load state (steps, mfd driver) stays as it is. The device
+	 * is copied to the region under load_lock.
+	 */
+	mutex_lock(&inst->load_lock);
+	if (req->keys & BIT(CFG_BUS_NR)) {
+		inst->bus = req->bus;
+		inst->dev = req->dev;
+		inst->func = req->func;
+		strncpy(inst->bdf, req->bdf, sizeof(inst->bdf));
+	}
+	if (req->keys & BIT(CFG_TYPE))
+		strncpy(inst->type, req->type, sizeof(inst->type));
+	bus = inst->bus;
+	slot = inst->dev;
+	func = inst->func;
+	memcpy(bdf, inst->bdf, sizeof(bdf));
+	if (!inst->history_header) {
+		fpga_cfg_history_header(inst);
+		fpga_cfg_update_hist_attr(inst);
+	}
+	down_read(&inst->pr_sem);
+	mutex_unlock(&inst->load_lock);
+
+	mutex_lock(&r->lock);
+	r->bus = bus;
+	r->dev = slot;
+	r->func = func;
+	memcpy(r->bdf, bdf, sizeof(r->bdf));
+	fpga_cfg_apply_image(&r->desc, &req->pr, req->keys & BIT(PR_MGR),
+			     req->keys & BIT(PR_META));
+	r->desc.upload = req->upload_type == PR_MGR ? req->upload : NULL;
+	r->desc.load_seq = seq;
+
+	if (inst->load_if_changed && fpga_cfg_pr_unchanged(inst, r)) {
+		if (inst->debug)
+			dev_info(dev, "Images unchanged, skip configuration\n");
+		sysfs_notify(&inst->kobj_fpga_dir, NULL, "ready");
+		ret = 0;
+		goto out;
+	}
+	r->cfg_done = false;
+	atomic_set(&inst->cfg_done, 0);
+
+	if (inst->debug)
+		dev_dbg(dev, "PR region %u cfg step start\n", r->idx);
+	start = local_clock();
+	mgr = fpga_cfg_pr_mgr_get(inst, r, &owner);
+	if (IS_ERR(mgr)) {
+		ret = PTR_ERR(mgr);
+		if (ret != -ENODEV)
+			dev_err(dev, "failed getting PR manager: %d\n", ret);
+		goto out;
+	}
+	if (inst->debug)
+		dev_dbg(dev, "Using PR manager: '%s'\n", mgr->name);
+
+	info.flags = FPGA_MGR_PARTIAL_RECONFIG;
+	ret = fpga_cfg_mgr_load(inst, mgr, &info, &r->desc);
+	fpga_cfg_pr_mgr_release(mgr, owner);
+	if (ret < 0)
+		goto out;
+	fpga_cfg_lat_add(&r->lat, local_clock() - start);
+	fpga_cfg_op_log(inst, &r->desc);
+	r->seq_num += 1;
+	r->cfg_done = true;
+	atomic_set(&inst->cfg_done, 1);
+	if (inst->debug)
+		dev_dbg(dev, "PR region %u cfg step done\n", r->idx);
+
+	sysfs_notify(&inst->kobj_fpga_dir, fpga_cfg_pr_groups[r->idx]->name,
+		     "current");
+	sysfs_notify(&inst->kobj_fpga_dir, NULL, "ready");
+out:
+	fpga_cfg_genl_load_end(inst, seq, ret, local_clock() - load_start,
+			       &r->desc, NULL, r->idx);
+	r->desc.upload = NULL;
+	mutex_unlock(&r->lock);
+	up_read(&inst->pr_sem);
+	return ret;
+}
+
+/* Run a parsed description, the image uploads of req are used once */
+static int fpga_cfg_run(struct fpga_cfg_fpga_inst *inst,
+			struct fpga_cfg_req *req)
+{
+	struct cfg_desc *desc = NULL;
+	u64 seq, start;
+	int ret;
+
+	seq = atomic64_inc_return(&inst->load_seq);
+	start = local_clock();
+	trace_fpga_cfg_load_start(inst->cfg->dir_buf, seq, req->cfg_op1,
+				  req->pr_region);
+
+	if (req->cfg_op1 == PR_MGR) {
+		ret = fpga_cfg_pr_load(inst, req, seq, start);
+		goto out;
+	}
+
+	mutex_lock(&inst->load_lock);
+	down_write(&inst->pr_sem);
+	inst->load_seq_cur = seq;
+	inst->fpp.load_seq = seq;
+	inst->spi.load_seq = seq;
+	inst->cvp.load_seq = seq;
+	ret = fpga_cfg_load(inst, req);
+	if (req->cfg_op1 == FPP_RING_MGR)
+		desc = &inst->fpp;
+	else if (req->cfg_op1 == SPI_RING_MGR || req->cfg_op1 == SPI_MGR)
+		desc = &inst->spi;
+	fpga_cfg_genl_load_end(inst, seq, ret, local_clock() - start, desc,
+			       req->cfg_op2 == CVP_MGR ? &inst->cvp : NULL, -1);
+	inst->fpp.upload = NULL;
+	inst->spi.upload = NULL;
+	inst->cvp.upload = NULL;
+	up_write(&inst->pr_sem);
+	mutex_unlock(&inst->load_lock);
+out:
+	trace_fpga_cfg_load_end(inst->cfg->dir_buf, seq, ret,
+				local_clock() - start);
+	return ret;
+}
+
+struct fpga_cfg_job {
+	struct work_struct work;
+	struct fpga_cfg_fpga_inst *inst;
+	struct fpga_cfg_req *req;
+	size_t id;
+	struct fpga_cfg_fleet *fleet;
+	int fleet_idx;
+	/* entry in pr_barriers, PR loads with gen <= job gen run before */
+	struct list_head barrier;
+	unsigned long gen;
+};
+
+static const char * const fpga_cfg_job_state_str[] = {
+	[FPGA_CFG_JOB_QUEUED]	= "queued",
+	[FPGA_CFG_JOB_RUNNING]	= "running",
+	[FPGA_CFG_JOB_DONE]	= "done",
+	[FPGA_CFG_JOB_FAILED]	= "failed",
+	[FPGA_CFG_JOB_SUPERSEDED] = "superseded",
+};
+
+static void fpga_cfg_job_set_state(struct fpga_cfg_fpga_inst *inst,
+				   size_t id, enum fpga_cfg_job_state state,
+				   int err)
+{
+	struct fpga_cfg_job_result *res;
+
+	mutex_lock(&inst->job_lock);
+	res = &inst->job_results[id % FPGA_CFG_JOB_RESULTS];
+	res->id = id;
+	res->state = state;
+	res->err = err;
+	/* jobs are queued in the context of the writer */
+	if (state == FPGA_CFG_JOB_QUEUED)
+		res->tgid = task_tgid_nr(current);
+	mutex_unlock(&inst->job_lock);
+}
+
+static void fpga_cfg_pr_kick(struct fpga_cfg_fpga_inst *inst);
+
+static void fpga_cfg_fleet_release(struct kref *ref)
+{
+	vfree(container_of(ref, struct fpga_cfg_fleet, ref));
+}
+
+static void fpga_cfg_job_work(struct work_struct *work)
+{
+	struct fpga_cfg_job *job = container_of(work, struct fpga_cfg_job,
+						work);
+	struct fpga_cfg_fpga_inst *inst = job->inst;
+	struct fpga_cfg_fleet_entry *entry = NULL;
+	bool pr = job->req->cfg_op1 == PR_MGR;
+	u64 start;
+	int ret;
+
+	/* PR loads queued before the job run first */
+	wait_event(inst->pr_queue_wq,
+		   READ_ONCE(inst->pr_oldest_gen) > job->gen);
+
+	if (job->fleet)
+		entry = &job->fleet->entries[job->fleet_idx];
+
+	fpga_cfg_job_set_state(inst, job->id, FPGA_CFG_JOB_RUNNING, 0);
+	start = local_clock();
+
+	ret = fpga_cfg_run(inst, job->req);
+
+	if (ret < 0) {
+		dev_warn(&inst->cfg->pdev->dev, "job %zu failed: %d\n",
+			 job->id, ret);
+		fpga_cfg_job_set_state(inst, job->id, FPGA_CFG_JOB_FAILED, ret);
+		/* success is notified by fpga_cfg_load(), failure here */
+		sysfs_notify(&inst->kobj_fpga_dir, NULL,
+			     pr ? "ready" : "status");
+	} else {
+		fpga_cfg_job_set_state(inst, job->id, FPGA_CFG_JOB_DONE, 0);
+	}
+
+	if (entry) {
+		entry->ret = ret;
+		entry->duration_ns = local_clock() - start;
+		if (atomic_dec_and_test(&job->fleet->pending))
+			complete(&job->fleet->done);
+		kref_put(&job->fleet->ref, fpga_cfg_fleet_release);
+	}
+
+	/* release the PR loads queued after the job */
+	mutex_lock(&inst->pr_queue_lock);
+	list_del(&job->barrier);
+	fpga_cfg_pr_kick(inst);
+	mutex_unlock(&inst->pr_queue_lock);
+
+	vfree(job->req);
+	kfree(job);
+}
+
+/*
+ * Queue a parsed description, the job takes ownership of req. Jobs
+ * queued for a fleet manifest report their result to fleet->entries.
+ */
+static int fpga_cfg_queue_job(struct fpga_cfg_fpga_inst *inst,
+			      struct fpga_cfg_req *req,
+			      struct fpga_cfg_fleet *fleet, int fleet_idx)
+{
+	struct fpga_cfg_job *job;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+
+	INIT_WORK(&job->work, fpga_cfg_job_work);
+	job->inst = inst;
+	job->req = req;
+	job->fleet = fleet;
+	job->fleet_idx = fleet_idx;
+
+	mutex_lock(&inst->job_lock);
+	job->id = ++inst->job_seq_num;
+	mutex_unlock(&inst->job_lock);
+
+	fpga_cfg_job_set_state(inst, job->id, FPGA_CFG_JOB_QUEUED, 0);
+	if (inst->debug)
+		dev_dbg(&inst->cfg->pdev->dev, "queue job %zu\n", job->id);
+
+	mutex_lock(&inst->pr_queue_lock);
+	if (inst->removing) {
+		mutex_unlock(&inst->pr_queue_lock);
+		fpga_cfg_job_set_state(inst, job->id, FPGA_CFG_JOB_FAILED,
+				       -ENODEV);
+		kfree(job);
+		return -ENODEV;
+	}
+	job->gen = inst->pr_queue_gen++;
+	list_add_tail(&job->barrier, &inst->pr_barriers);
+	if (fleet)
+		kref_get(&fleet->ref);
+	queue_work(inst->job_wq, &job->work);
+	mutex_unlock(&inst->pr_queue_lock);
+	return 0;
+}
+
+/*
+ * Update the gen of the oldest queued or running PR load, the queue is
+ * ordered by gen. Called with pr_queue_lock held.
+ */
+static void fpga_cfg_pr_oldest_update(struct fpga_cfg_fpga_inst *inst)
+{
+	struct fpga_cfg_pr_pending *p;
+
+	p = list_first_entry_or_null(&inst->pr_queue,
+				     struct fpga_cfg_pr_pending, list);
+	WRITE_ONCE(inst->pr_oldest_gen, p ? p->gen : ULONG_MAX);
+	wake_up(&inst->pr_queue_wq);
+}
+
+/*
+ * Pending PR load of region to run next: the oldest one, if no job
+ * queued before it is left. Called with pr_queue_lock held.
+ */
+static struct fpga_cfg_pr_pending *
+fpga_cfg_pr_queue_next(struct fpga_cfg_fpga_inst *inst, unsigned int region)
+{
+	struct fpga_cfg_job *job;
+	struct fpga_cfg_pr_pending *p;
+
+	job = list_first_entry_or_null(&inst->pr_barriers,
+				       struct fpga_cfg_job, barrier);
+	list_for_each_entry(p, &inst->pr_queue, list) {
+		if (p->region != region)
+			continue;
+		if (p->running || (job && p->gen > job->gen))
+			return NULL;
+		return p;
+	}
+	return NULL;
+}
+
+/*
+ * Start runnable loads while fewer than fpgacfg_pr_jobs run: the one
+ * with the highest priority first, of equal ones the oldest request.
+ * Called with pr_queue_lock held.
+ */
+static void fpga_cfg_pr_kick(struct fpga_cfg_fpga_inst *inst)
+{
+	unsigned int max = clamp_t(unsigned int, READ_ONCE(fpgacfg_pr_jobs),
+				   1, FPGA_CFG_PR_REGIONS);
+	struct fpga_cfg_pr_pending *p, *best;
+	int i;
+
+	while (inst->pr_running < max) {
+		best = NULL;
+		for (i = 0; i < FPGA_CFG_PR_REGIONS; i++) {
+			p = fpga_cfg_pr_queue_next(inst, i);
+			if (p && (!best || p->prio > best->prio ||
+				  (p->prio == best->prio && p->id < best->id)))
+				best = p;
+		}
+		if (!best)
+			break;
+
+		best->running = true;
+		inst->pr_running++;
+		inst->pr_queue_depth--;
+		inst->pr_workers[best->region].p = best;
+		queue_work(inst->pr_wq, &inst->pr_workers[best->region].work);
+	}
+}
+
+/* Run the PR load started for the region by fpga_cfg_pr_kick() */
+static void fpga_cfg_pr_work(struct work_struct *work)
+{
+	struct fpga_cfg_pr_worker *w = container_of(work,
+						    struct fpga_cfg_pr_worker,
+						    work);
+	struct fpga_cfg_fpga_inst *inst = w->inst;
+	struct fpga_cfg_pr_pending *p;
+	int ret;
+
+	mutex_lock(&inst->pr_queue_lock);
+	p = w->p;
+	w->p = NULL;
+	mutex_unlock(&inst->pr_queue_lock);
+	if (!p)
+		return;
+
+	fpga_cfg_lat_add(&inst->pr_wait_lat, local_clock() - p->queued_ns);
+	fpga_cfg_job_set_state(inst, p->id, FPGA_CFG_JOB_RUNNING, 0);
+
+	ret = fpga_cfg_run(inst, p->req);
+	if (ret < 0) {
+		dev_warn(&inst->cfg->pdev->dev, "job %zu failed: %d\n",
+			 p->id, ret);
+		fpga_cfg_job_set_state(inst, p->id, FPGA_CFG_JOB_FAILED, ret);
+		sysfs_notify(&inst->kobj_fpga_dir, NULL, "ready");
+	} else {
+		fpga_cfg_job_set_state(inst, p->id, FPGA_CFG_JOB_DONE, 0);
+	}
+
+	mutex_lock(&inst->pr_queue_lock);
+	list_del(&p->list);
+	inst->pr_running--;
+	fpga_cfg_pr_oldest_update(inst);
+	fpga_cfg_pr_kick(inst);
+	mutex_unlock(&inst->pr_queue_lock);
+	vfree(p->req);
+	kfree(p);
+}
+
+/*
+ * Queue a PR load in async mode, the queue takes ownership of req. A
+ * load pending for the same region since the last job barrier is
+ * superseded by req.
+ */
+static int fpga_cfg_pr_queue(struct fpga_cfg_fpga_inst *inst,
+			     struct fpga_cfg_req *req)
+{
+	struct device *dev = &inst->cfg->pdev->dev;
+	struct fpga_cfg_pr_pending *p, *new;
+	struct fpga_cfg_req *old = NULL;
+	size_t id, old_id = 0;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	mutex_lock(&inst->job_lock);
+	id = ++inst->job_seq_num;
+	mutex_unlock(&inst->job_lock);
+	fpga_cfg_job_set_state(inst, id, FPGA_CFG_JOB_QUEUED, 0);
+
+	mutex_lock(&inst->pr_queue_lock);
+	if (inst->removing) {
+		mutex_unlock(&inst->pr_queue_lock);
+		fpga_cfg_job_set_state(inst, id, FPGA_CFG_JOB_FAILED, -ENODEV);
+		kfree(new);
+		return -ENODEV;
+	}
+	inst->pr_queued++;
+	list_for_each_entry(p, &inst->pr_queue, list) {
+		if (p->gen == inst->pr_queue_gen && !p->running &&
+		    p->region == req->pr_region) {
+			old = p->req;
+			old_id = p->id;
+			break;
+		}
+	}
+	if (old) {
+		inst->pr_coalesced++;
+		kfree(new);
+	} else {
+		p = new;
+		p->region = req->pr_region;
+		p->gen = inst->pr_queue_gen;
+		list_add_tail(&p->list, &inst->pr_queue);
+		inst->pr_queue_depth++;
+		if (inst->pr_queue_depth > inst->pr_queue_max)
+			inst->pr_queue_max = inst->pr_queue_depth;
+	}
+	p->req = req;
+	p->id = id;
+	p->prio = req->pr_prio;
+	p->queued_ns = local_clock();
+	/* also after coalescing, waiters see the updated request */
+	fpga_cfg_pr_oldest_update(inst);
+	fpga_cfg_pr_kick(inst);
+	mutex_unlock(&inst->pr_queue_lock);
+
+	if (old) {
+		fpga_cfg_job_set_state(inst, old_id, FPGA_CFG_JOB_SUPERSEDED,
+				       0);
+		vfree(old);
+	}
+	if (inst->debug)
+		dev_dbg(dev, "queue PR job %zu, region %u, prio %u%s\n", id,
+			req->pr_region, req->pr_prio,
+			old ? ", coalesced" : "");
+	return 0;
+}
+
+static int fpga_cfg_req_check(struct fpga_cfg_fpga_inst *inst,
+			      struct fpga_cfg_req *req)
+{
+	if ((req->cfg_op1 == FPP_RING_MGR || req->cfg_op1 == SPI_RING_MGR) &&
+	    !inst->fpp.mgr && !inst->spi.mgr)
+		return -ENODEV;
+	return 0;
+}
+
+/*
+ * Check the framing of a description and parse it into a new request.
+ * Returns the request (to be freed with vfree()) or ERR_PTR().
+ */
+static struct fpga_cfg_req *fpga_cfg_req_create(struct fpga_cfg_fpga_inst *inst,
+						const char *buf, size_t size)
+{
+	struct fpga_cfg_req *req;
+	struct device *dev;
+	const char *start, *end;
+	u64 start_ns;
+	int ret;
+
+	if (size < 4 || size > SZ_16K)
+		return ERR_PTR(-EINVAL);
+
+	if (!inst->cfg) {
+		if (inst->debug)
+			pr_debug("No cfg device\n");
+		return ERR_PTR(-ENODEV);
+	}
+
+	dev = &inst->cfg->pdev->dev;
+
+	start = buf;
+	end = buf + size - 3;
+
+	if (strncmp(start, "{\n", 2) || strncmp(end, "\n}\n", 3)) {
+		dev_err(dev, "Invalid firmware description.\n");
+		if (inst->debug)
+			dev_dbg(dev, "'%.*s', size %zd\n", (int)size, start,
+				size);
+		return ERR_PTR(-EINVAL);
+	}
+
+	req = vzalloc(sizeof(*req));
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+
+	start_ns = fpga_cfg_stage_begin(inst, 0, FPGA_CFG_STAGE_PARSE);
+	ret = fpga_cfg_desc_parse(inst, req, buf, size);
+	fpga_cfg_stage_end(inst, 0, FPGA_CFG_STAGE_PARSE, start_ns, size, ret);
+	if (ret < 0)
+		goto err;
+
+	ret = fpga_cfg_req_check(inst, req);
+	if (ret < 0)
+		goto err;
+	return req;
+err:
+	vfree(req);
+	return ERR_PTR(ret);
+}
+
+/* Called with profile_lock held */
+static struct fpga_cfg_profile *
+fpga_cfg_profile_find(struct fpga_cfg_fpga_inst *inst,
+		      const char *name, size_t len)
+{
+	struct fpga_cfg_profile *prof;
+
+	list_for_each_entry(prof, &inst->profiles, list) {
+		if (strlen(prof->name) == len && !memcmp(prof->name, name, len))
+			return prof;
+	}
+	return NULL;
+}
+
+/*
+ * Request for a load by profile name, a copy of the request parsed
+ * on registration. Returns the request (to be freed with vfree()).
+ */
+static struct fpga_cfg_req *fpga_cfg_profile_req(struct fpga_cfg_fpga_inst *inst,
+						 const char *name, size_t len)
+{
+	struct fpga_cfg_profile *prof;
+	struct fpga_cfg_req *req;
+
+	while (len && isspace(name[len - 1]))
+		len--;
+
+	req = vmalloc(sizeof(*req));
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_lock(&inst->profile_lock);
+	prof = fpga_cfg_profile_find(inst, name, len);
+	if (prof)
+		memcpy(req, prof->req, sizeof(*req));
+	mutex_unlock(&inst->profile_lock);
+
+	if (!prof) {
+		if (inst->cfg)
+			dev_err(&inst->cfg->pdev->dev, "No profile '%.*s'\n",
+				(int)len, name);
+		vfree(req);
+		return ERR_PTR(-ENOENT);
+	}
+	return req;
+}
+
+/* Request for a description or, if not starting with '{', a profile name */
+static struct fpga_cfg_req *fpga_cfg_req_get(struct fpga_cfg_fpga_inst *inst,
+					     const char *buf, size_t size)
+{
+	if (size && buf[0] != '{')
+		return fpga_cfg_profile_req(inst, buf, size);
+	return fpga_cfg_req_create(inst, buf, size);
+}
+
+static ssize_t store_load(struct fpga_cfg_fpga_inst *inst,
+			  struct attribute *attr,
+			  const char *buf, size_t size)
+{
+	struct fpga_cfg_req *req;
+	int ret;
+
+	req = fpga_cfg_req_get(inst, buf, size);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (inst->async) {
+		if (req->cfg_op1 == PR_MGR)
+			ret = fpga_cfg_pr_queue(inst, req);
+		else
+			ret = fpga_cfg_queue_job(inst, req, NULL, 0);
+		if (!ret)
+			return size;
+		goto out;
+	}
+
+	ret = fpga_cfg_run(inst, req);
+out:
+	vfree(req);
+	return ret < 0 ? ret : size;
+}
+
+/* Check that the images of a profile can be found when it is loaded */
+static int fpga_cfg_req_resolve(struct fpga_cfg_fpga_inst *inst,
+				struct fpga_cfg_req *req)
+{
+	struct cfg_image *imgs[] = { &req->fpp, &req->spi, &req->cvp,
+				     &req->pr };
+	struct path path;
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(imgs); i++) {
+		if (!imgs[i]->firmware_abs[0])
+			continue;
+		ret = kern_path(imgs[i]->firmware_abs, LOOKUP_FOLLOW, &path);
+		if (ret) {
+			dev_err(&inst->cfg->pdev->dev, "Can't find '%s': %d\n",
+				imgs[i]->firmware_abs, ret);
+			return ret;
+		}
+		path_put(&path);
+	}
+	return 0;
+}
+
+static bool fpga_cfg_profile_name_valid(const char *name, size_t len)
+{
+	size_t i;
+
+	if (!len || len >= sizeof(((struct fpga_cfg_profile *)0)->name))
+		return false;
+	if ((len == 8 && !memcmp(name, "register", 8)) ||
+	    (len == 10 && !memcmp(name, "unregister", 10)))
+		return false;
+	for (i = 0; i < len; i++) {
+		if (!isalnum(name[i]) && !strchr("_-.", name[i]))
+			return false;
+	}
+	return true;
+}
+
+static void fpga_cfg_profile_free(struct fpga_cfg_profile *prof)
+{
+	vfree(prof->req);
+	kfree(prof->desc);
+	kfree(prof);
+}
+
+static ssize_t fpga_cfg_profile_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_profile *prof = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, prof->desc,
+				       prof->desc_len);
+}
+
+static const struct file_operations dbgfs_profile_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_profile_read,
+	.llseek = default_llseek,
+};
+
+/*
+ * Register a profile written as "<name> {\n ... \n}\n", a profile with
+ * the same name is replaced.
+ */
+static ssize_t fpga_cfg_profile_register(struct file *file,
+					 const char __user *ubuf,
+					 size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	struct fpga_cfg_profile *prof, *old;
+	struct fpga_cfg_req *req;
+	char *buf, *name, *desc;
+	size_t len;
+	int ret;
+
+	if (!count || count > SZ_16K)
+		return -EINVAL;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	name = skip_spaces(buf);
+	len = strcspn(name, " \t\n");
+	desc = name + len;
+	desc += strspn(desc, " \t");
+	if (!fpga_cfg_profile_name_valid(name, len) || *desc != '{') {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	req = fpga_cfg_req_create(inst, desc, strlen(desc));
+	if (IS_ERR(req)) {
+		ret = PTR_ERR(req);
+		goto out;
+	}
+
+	ret = fpga_cfg_req_resolve(inst, req);
+	if (ret)
+		goto err_req;
+
+	prof = kzalloc(sizeof(*prof), GFP_KERNEL);
+	if (!prof) {
+		ret = -ENOMEM;
+		goto err_req;
+	}
+	memcpy(prof->name, name, len);
+	prof->req = req;
+	prof->desc_len = strlen(desc);
+	prof->desc = kmemdup(desc, prof->desc_len, GFP_KERNEL);
+	if (!prof->desc) {
+		ret = -ENOMEM;
+		goto err_prof;
+	}
+
+	mutex_lock(&inst->profile_lock);
+	old = fpga_cfg_profile_find(inst, name, len);
+	if (!old && inst->nr_profiles == FPGA_CFG_PROFILES_MAX) {
+		mutex_unlock(&inst->profile_lock);
+		ret = -ENOSPC;
+		goto err_prof;
+	}
+	if (old) {
+		list_del(&old->list);
+		debugfs_remove(old->dentry);
+		inst->nr_profiles--;
+	}
+	list_add_tail(&prof->list, &inst->profiles);
+	inst->nr_profiles++;
+	prof->dentry = debugfs_create_file(prof->name, 0444,
+					   inst->dbgfs_profiles, prof,
+					   &dbgfs_profile_ops);
+	mutex_unlock(&inst->profile_lock);
+
+	if (old)
+		fpga_cfg_profile_free(old);
+	if (inst->debug)
+		dev_dbg(&inst->cfg->pdev->dev, "Registered profile '%s'\n",
+			prof->name);
+	kfree(buf);
+	return count;
+
+err_prof:
+	kfree(prof->desc);
+	kfree(prof);
+err_req:
+	vfree(req);
+out:
+	kfree(buf);
+	return ret;
+}
+
+static ssize_t fpga_cfg_profile_unregister(struct file *file,
+					   const char __user *ubuf,
+					   size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	struct fpga_cfg_profile *prof;
+	char name[32];
+	char *p;
+
+	if (!count || count >= sizeof(name))
+		return -EINVAL;
+	if (copy_from_user(name, ubuf, count))
+		return -EFAULT;
+	name[count] = 0;
+	p = strim(name);
+
+	mutex_lock(&inst->profile_lock);
+	prof = fpga_cfg_profile_find(inst, p, strlen(p));
+	if (prof) {
+		list_del(&prof->list);
+		debugfs_remove(prof->dentry);
+		inst->nr_profiles--;
+	}
+	mutex_unlock(&inst->profile_lock);
+
+	if (!prof)
+		return -ENOENT;
+	fpga_cfg_profile_free(prof);
+	return count;
+}
+
+/* Called on remove, after the debugfs files are gone */
+static void fpga_cfg_profiles_free(struct fpga_cfg_fpga_inst *inst)
+{
+	struct fpga_cfg_profile *prof, *tmp;
+
+	list_for_each_entry_safe(prof, tmp, &inst->profiles, list) {
+		list_del(&prof->list);
+		fpga_cfg_profile_free(prof);
+	}
+	inst->nr_profiles = 0;
+}
+
+static const struct file_operations dbgfs_profile_register_ops = {
+	.open = simple_open,
+	.write = fpga_cfg_profile_register,
+	.llseek = default_llseek,
+};
+
+static const struct file_operations dbgfs_profile_unregister_ops = {
+	.open = simple_open,
+	.write = fpga_cfg_profile_unregister,
+	.llseek = default_llseek,
+};
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+/*
+ * Upload device /dev/fpga_cfg/<name>. The image is written to the
+ * device into pages and loaded with FPGA_CFG_IOC_LOAD, without a file
+ * under /lib/firmware. The device structure is refcounted by the open
+ * files, inst is cleared when the instance is removed, which waits for
+ * the running loads. The pages staged by all open files of a device
+ * are limited to FPGA_CFG_UPLOAD_MAX.
+ */
+#define FPGA_CFG_UPLOAD_MAX	FPGA_CFG_PAGES_MAX
+
+struct fpga_cfg_upload_dev {
+	struct miscdevice misc;
+	struct kref ref;
+	struct mutex lock;	/* protects inst, loads and staged */
+	struct fpga_cfg_fpga_inst *inst;
+	unsigned int loads;
+	wait_queue_head_t wq_loads;
+	size_t staged;
+	char name[32];
+	char nodename[48];
+};
+
+struct fpga_cfg_upload_file {
+	struct fpga_cfg_upload_dev *udev;
+	struct mutex lock;
+	struct fpga_cfg_pages pages;
+};
+
+static void fpga_cfg_upload_dev_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct fpga_cfg_upload_dev, ref));
+}
+
+/* Instance of the device for one load, NULL if it was removed */
+static struct fpga_cfg_fpga_inst *fpga_cfg_upload_get(struct fpga_cfg_upload_dev *udev)
+{
+	struct fpga_cfg_fpga_inst *inst;
+
+	mutex_lock(&udev->lock);
+	inst = udev->inst;
+	if (inst)
+		udev->loads++;
+	mutex_unlock(&udev->lock);
+	return inst;
+}
+
+static void fpga_cfg_upload_put(struct fpga_cfg_upload_dev *udev)
+{
+	mutex_lock(&udev->lock);
+	if (!--udev->loads)
+		wake_up(&udev->wq_loads);
+	mutex_unlock(&udev->lock);
+}
+
+/* Account a page staged by a file of the device */
+static int fpga_cfg_upload_stage(struct fpga_cfg_upload_dev *udev)
+{
+	int ret = 0;
+
+	mutex_lock(&udev->lock);
+	if (udev->staged + PAGE_SIZE > FPGA_CFG_UPLOAD_MAX)
+		ret = -ENOMEM;
+	else
+		udev->staged += PAGE_SIZE;
+	mutex_unlock(&udev->lock);
+	return ret;
+}
+
+static void fpga_cfg_upload_unstage(struct fpga_cfg_upload_dev *udev,
+				    unsigned int nr)
+{
+	mutex_lock(&udev->lock);
+	udev->staged -= (size_t)nr * PAGE_SIZE;
+	mutex_unlock(&udev->lock);
+}
+
+static void fpga_cfg_upload_pages_free(struct fpga_cfg_upload_dev *udev,
+				       struct fpga_cfg_pages *p)
+{
+	fpga_cfg_upload_unstage(udev, p->nr);
+	fpga_cfg_pages_free(p);
+}
+
+/*
+ * Read an image passed as file descriptor into pages staged on udev.
+ * Only regular files are accepted and read up to their size, so the
+ * staging limit bounds the pages like for uploaded images.
+ */
+static int fpga_cfg_upload_read_fd(struct fpga_cfg_upload_dev *udev,
+				   struct file *filp, struct fpga_cfg_pages *p)
+{
+	struct inode *inode = file_inode(filp);
+	loff_t size, pos = 0;
+	size_t off, want;
+	ssize_t n = 0;
+	u8 *addr;
+	int ret = 0;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	size = i_size_read(inode);
+	if (!size)
+		return -EINVAL;
+	if (size > FPGA_CFG_UPLOAD_MAX)
+		return -EFBIG;
+
+	while (p->len < size) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		ret = fpga_cfg_upload_stage(udev);
+		if (ret)
+			break;
+		addr = fpga_cfg_pages_add(p);
+		if (!addr) {
+			fpga_cfg_upload_unstage(udev, 1);
+			ret = -ENOMEM;
+			break;
+		}
+		want = min_t(loff_t, PAGE_SIZE, size - p->len);
+		for (off = 0; off < want; off += n) {
+			n = kernel_read(filp, addr + off, want - off, &pos);
+			if (n <= 0)
+				break;
+		}
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		p->len += off;
+		/* the file was truncated while it was read */
+		if (off < want) {
+			if (!off) {
+				__free_page(p->pages[--p->nr]);
+				fpga_cfg_upload_unstage(udev, 1);
+			}
+			break;
+		}
+	}
+
+	if (!ret && !p->len)
+		ret = -EINVAL;
+	if (ret)
+		fpga_cfg_upload_pages_free(udev, p);
+	return ret;
+}
+
+static int fpga_cfg_upload_open(struct inode *inode, struct file *file)
+{
+	struct fpga_cfg_upload_dev *udev;
+	struct fpga_cfg_upload_file *uf;
+
+	udev = container_of(file->private_data, struct fpga_cfg_upload_dev,
+			    misc);
+
+	uf = kzalloc(sizeof(*uf), GFP_KERNEL);
+	if (!uf)
+		return -ENOMEM;
+
+	mutex_init(&uf->lock);
+	uf->udev = udev;
+	kref_get(&udev->ref);
+	file->private_data = uf;
+
+	return nonseekable_open(inode, file);
+}
+
+static int fpga_cfg_upload_release(struct inode *inode, struct file *file)
+{
+	struct fpga_cfg_upload_file *uf = file->private_data;
+
+	fpga_cfg_upload_pages_free(uf->udev, &uf->pages);
+	kref_put(&uf->udev->ref, fpga_cfg_upload_dev_release);
+	kfree(uf);
+	return 0;
+}
+
+static ssize_t fpga_cfg_upload_write_iter(struct kiocb *iocb,
+					  struct iov_iter *from)
+{
+	struct fpga_cfg_upload_file *uf = iocb->ki_filp->private_data;
+	struct fpga_cfg_pages *p = &uf->pages;
+	ssize_t total = 0;
+	size_t off, n;
+	int ret = 0;
+
+	mutex_lock(&uf->lock);
+	while (iov_iter_count(from)) {
+		if (p->len == (size_t)p->nr * PAGE_SIZE) {
+			ret = fpga_cfg_upload_stage(uf->udev);
+			if (ret)
+				break;
+			if (!fpga_cfg_pages_add(p)) {
+				fpga_cfg_upload_unstage(uf->udev, 1);
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		off = p->len - (size_t)(p->nr - 1) * PAGE_SIZE;
+		n = copy_page_from_iter(p->pages[p->nr - 1], off,
+					PAGE_SIZE - off, from);
+		if (!n) {
+			ret = -EFAULT;
+			break;
+		}
+		p->len += n;
+		total += n;
+	}
+	mutex_unlock(&uf->lock);
+
+	return total ? total : ret;
+}
+
+/* Use the uploaded pages as image of the given configuration step */
+static int fpga_cfg_req_set_upload(struct fpga_cfg_fpga_inst *inst,
+				   struct fpga_cfg_req *req, u32 step,
+				   struct fpga_cfg_pages *pages,
+				   const char *name)
+{
+	struct cfg_image *img;
+
+	switch (step) {
+	case FPGA_CFG_UPLOAD_FPP:
+		if (!inst->fpp.mgr)
+			return -ENODEV;
+		img = &req->fpp;
+		req->cfg_op1 = FPP_RING_MGR;
+		req->upload_type = FPP_RING_MGR;
+		break;
+	case FPGA_CFG_UPLOAD_SPI:
+		if (!inst->spi.mgr)
+			return -ENODEV;
+		img = &req->spi;
+		req->cfg_op1 = inst->mgr_type;
+		req->upload_type = SPI_RING_MGR;
+		break;
+	case FPGA_CFG_UPLOAD_CVP:
+		img = &req->cvp;
+		req->cfg_op2 = CVP_MGR;
+		req->upload_type = CVP_MGR;
+		break;
+	case FPGA_CFG_UPLOAD_PR:
+		img = &req->pr;
+		req->cfg_op1 = PR_MGR;
+		req->upload_type = PR_MGR;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	req->keys |= BIT(req->upload_type);
+	req->upload = pages;
+	strscpy(img->firmware, "upload", sizeof(img->firmware));
+	strscpy(img->firmware_abs, name, sizeof(img->firmware_abs));
+
+	return 0;
+}
+
+/*
+ * Run a load with an image in pages, the upload is reset afterwards.
+ * The pages are taken from the file before the load, so the file can
+ * stage the next image while the load runs.
+ */
+static long fpga_cfg_upload_load(struct fpga_cfg_upload_file *uf,
+				 void __user *argp)
+{
+	struct fpga_cfg_pages pages = {};
+	struct fpga_cfg_fpga_inst *inst;
+	struct fpga_cfg_upload arg;
+	struct fpga_cfg_req *req;
+	char name[64];
+	char *desc = NULL;
+	int ret;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.desc_len) {
+		desc = memdup_user(u64_to_user_ptr(arg.desc), arg.desc_len);
+		if (IS_ERR(desc))
+			return PTR_ERR(desc);
+	}
+
+	inst = fpga_cfg_upload_get(uf->udev);
+	if (!inst) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	/* all options are optional, the image is in uf->pages */
+	if (desc)
+		req = fpga_cfg_req_create(inst, desc, arg.desc_len);
+	else
+		req = fpga_cfg_req_create(inst, "{\n}\n", 4);
+	if (IS_ERR(req)) {
+		ret = PTR_ERR(req);
+		goto out_put;
+	}
+
+	snprintf(name, sizeof(name), "/dev/%s", uf->udev->nodename);
+	ret = fpga_cfg_req_set_upload(inst, req, arg.step, &pages, name);
+	if (ret)
+		goto out_req;
+
+	mutex_lock(&uf->lock);
+	if (uf->pages.len) {
+		pages = uf->pages;
+		memset(&uf->pages, 0, sizeof(uf->pages));
+	}
+	mutex_unlock(&uf->lock);
+	if (!pages.len) {
+		ret = -ENODATA;
+		goto out_req;
+	}
+
+	ret = fpga_cfg_run(inst, req);
+	fpga_cfg_upload_pages_free(uf->udev, &pages);
+out_req:
+	vfree(req);
+out_put:
+	fpga_cfg_upload_put(uf->udev);
+out:
+	kfree(desc);
+	return ret;
+}
+
+/* Keys of the binary description entries with string values */
+static const enum fpga_cfg_mgr_type fpga_cfg_tlv_keys[] = {
+	[FPGA_CFG_TLV_FPGA_TYPE]	= CFG_TYPE,
+	[FPGA_CFG_TLV_USB_DEV_ID]	= CFG_USB_ID,
+	[FPGA_CFG_TLV_FPP_IMAGE]	= FPP_RING_MGR,
+	[FPGA_CFG_TLV_SPI_IMAGE]	= SPI_RING_MGR,
+	[FPGA_CFG_TLV_CVP_IMAGE]	= CVP_MGR,
+	[FPGA_CFG_TLV_PR_IMAGE]		= PR_MGR,
+	[FPGA_CFG_TLV_FPP_META]		= FPP_META,
+	[FPGA_CFG_TLV_SPI_META]		= SPI_META,
+	[FPGA_CFG_TLV_CVP_META]		= CVP_META,
+	[FPGA_CFG_TLV_PR_META]		= PR_META,
+	[FPGA_CFG_TLV_MFD_DRIVER]	= FPGA_DRV,
+	[FPGA_CFG_TLV_MFD_DRIVER_PARAM]	= FPGA_DRV_ARGS,
+	[FPGA_CFG_TLV_PR_REGION]	= PR_REGION,
+	[FPGA_CFG_TLV_PR_PRIORITY]	= PR_PRIO,
+};
+
+static int fpga_cfg_tlv_parse(struct fpga_cfg_fpga_inst *inst,
+			      struct fpga_cfg_req *req,
+			      const u8 *buf, size_t size,
+			      struct fpga_cfg_tlv_fd *img_fd)
+{
+	struct device *dev = &inst->cfg->pdev->dev;
+	const struct fpga_cfg_tlv *tlv;
+	struct fpga_cfg_tlv_bdf bdf;
+	enum fpga_cfg_mgr_type type;
+	size_t pos = 0;
+	u32 lsb;
+	char *val;
+	int ret = 0;
+
+	val = kmalloc(VAL_SZ + 1, GFP_KERNEL);
+	if (!val)
+		return -ENOMEM;
 
-			if (inst->debug)
-				dev_dbg(dev, "PCI bus rescan\n");
-			pci_bus_rescan(inst, bus, inst->fpga_drv);
-			if (inst->debug) {
-				dev_dbg(dev, "PCI bus rescan done\n");
-				dev_dbg(dev, "CvP device reattach done\n");
-			}
-		} else
-#endif
-	{
-		/* Detach CvP driver and bind to mfd driver */
-		pci_device_driver_unbind(&pdev->dev);
+	img_fd->fd = -1;
 
-		/* Load fpga driver module with custom parameters */
-		ret = fpga_cfg_modprobe(inst->fpga_drv, UMH_WAIT_PROC,
-					false, inst->fpga_drv_args);
-		if (ret < 0)
-			dev_warn(dev, "Failed to load module '%s %s': err %d\n",
-				 inst->fpga_drv, inst->fpga_drv_args, ret);
+	while (!ret && pos + sizeof(*tlv) <= size) {
+		tlv = (const struct fpga_cfg_tlv *)(buf + pos);
+		if (tlv->len > size - pos - sizeof(*tlv)) {
+			ret = -EINVAL;
+			break;
+		}
 
-		inst->driver_to_bind = inst->fpga_drv;
-		list_add_tail(&inst->link, &pci_dev_wait_list);
-		ret = pci_device_driver_bind(pdev, inst, inst->fpga_drv);
+		switch (tlv->type) {
+		case FPGA_CFG_TLV_BDF:
+			if (tlv->len != sizeof(bdf) ||
+			    (req->keys & BIT(CFG_BUS_NR))) {
+				ret = -EINVAL;
+				break;
+			}
+			memcpy(&bdf, tlv->value, sizeof(bdf));
+			if (bdf.dev > 31 || bdf.func > 7) {
+				ret = -EINVAL;
+				break;
+			}
+			req->keys |= BIT(CFG_BUS_NR);
+			req->bus = bdf.bus;
+			req->dev = bdf.dev;
+			req->func = bdf.func;
+			snprintf(req->bdf, sizeof(req->bdf), "%02x:%02x.%x",
+				 bdf.bus, bdf.dev, bdf.func);
+			break;
+		case FPGA_CFG_TLV_SPI_LSB_FIRST:
+			if (tlv->len != sizeof(lsb) ||
+			    (req->keys & BIT(CFG_BS_LSB))) {
+				ret = -EINVAL;
+				break;
+			}
+			memcpy(&lsb, tlv->value, sizeof(lsb));
+			req->keys |= BIT(CFG_BS_LSB);
+			req->bs_lsb_first = !!lsb;
+			break;
+		case FPGA_CFG_TLV_IMAGE_FD:
+			if (tlv->len != sizeof(*img_fd) || img_fd->fd >= 0) {
+				ret = -EINVAL;
+				break;
+			}
+			memcpy(img_fd, tlv->value, sizeof(*img_fd));
+			if (img_fd->fd < 0)
+				ret = -EBADF;
+			break;
+		default:
+			type = tlv->type < ARRAY_SIZE(fpga_cfg_tlv_keys) ?
+			       fpga_cfg_tlv_keys[tlv->type] : NOP_MGR;
+			if (type == NOP_MGR || tlv->len > VAL_SZ ||
+			    (req->keys & BIT(type))) {
+				ret = -EINVAL;
+				break;
+			}
+			memcpy(val, tlv->value, tlv->len);
+			val[tlv->len] = '\0';
+			req->keys |= BIT(type);
+			ret = fpga_cfg_assign(inst, req, type, val);
+			break;
+		}
 		if (ret)
-			dev_err(dev, "PCIe dev bind error %d\n", ret);
+			dev_err(dev, "Invalid description entry %u, len %u\n",
+				tlv->type, tlv->len);
+
+		pos += ALIGN(sizeof(*tlv) + tlv->len, 4);
 	}
-	return 0;
-err:
+
+	/* trailing bytes not forming an entry */
+	if (!ret && pos < size)
+		ret = -EINVAL;
+
+	kfree(val);
 	return ret;
 }
 
-static ssize_t store_load(struct fpga_cfg_fpga_inst *inst,
-			  struct attribute *attr,
-			  const char *buf, size_t size)
+/* Load a binary description, an image passed as fd is read to pages */
+static long fpga_cfg_upload_load_desc(struct fpga_cfg_upload_file *uf,
+				      void __user *argp)
 {
-	struct cfg_desc *desc;
-	struct pci_dev *pdev;
-	struct pci_bus __maybe_unused *bus;
-	struct device *dev;
-	const char *start, *end;
-	struct fpga_image_info info;
+	struct fpga_cfg_pages pages = {};
+	struct fpga_cfg_fpga_inst *inst;
+	struct fpga_cfg_tlv_fd img_fd;
+	struct fpga_cfg_desc arg;
+	struct fpga_cfg_req *req;
+	struct file *filp;
+	char name[NAME_MAX];
+	u64 start;
+	u8 *buf;
 	int ret;
 
-	if (!size || size > SZ_16K)
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.flags || !arg.len || arg.len > SZ_16K)
 		return -EINVAL;
 
-	if (!inst->cfg) {
-		if (inst->debug)
-			pr_debug("No cfg device\n");
-		return -ENODEV;
+	buf = memdup_user(u64_to_user_ptr(arg.data), arg.len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	req = vzalloc(sizeof(*req));
+	if (!req) {
+		kfree(buf);
+		return -ENOMEM;
 	}
+	fpga_cfg_req_init(req);
 
-	dev = &inst->cfg->pdev->dev;
+	inst = fpga_cfg_upload_get(uf->udev);
+	if (!inst) {
+		ret = -ENODEV;
+		goto out;
+	}
 
-	start = buf;
-	end = buf + size - 3;
+	start = fpga_cfg_stage_begin(inst, 0, FPGA_CFG_STAGE_PARSE);
+	ret = fpga_cfg_tlv_parse(inst, req, buf, arg.len, &img_fd);
+	fpga_cfg_stage_end(inst, 0, FPGA_CFG_STAGE_PARSE, start, arg.len, ret);
+	if (!ret)
+		ret = fpga_cfg_req_check(inst, req);
+	if (!ret && img_fd.fd >= 0) {
+		filp = fget(img_fd.fd);
+		if (!filp) {
+			ret = -EBADF;
+			goto out_put;
+		}
+		snprintf(name, sizeof(name), "fd:%pD", filp);
+		ret = fpga_cfg_upload_read_fd(uf->udev, filp, &pages);
+		fput(filp);
+		if (!ret)
+			ret = fpga_cfg_req_set_upload(inst, req, img_fd.step,
+						      &pages, name);
+	}
+	if (!ret)
+		ret = fpga_cfg_run(inst, req);
+out_put:
+	fpga_cfg_upload_put(uf->udev);
+out:
+	fpga_cfg_upload_pages_free(uf->udev, &pages);
+	vfree(req);
+	kfree(buf);
+	return ret;
+}
 
-	if (strncmp(start, "{\n", 2) || strncmp(end, "\n}\n", 3)) {
-		dev_err(dev, "Invalid firmware description.\n");
-		if (inst->debug)
-			dev_dbg(dev, "'%s', size %zd\n", start, size);
-		return -EINVAL;
+static long fpga_cfg_upload_ioctl(struct file *file, unsigned int cmd,
+				  unsigned long arg)
+{
+	struct fpga_cfg_upload_file *uf = file->private_data;
+
+	switch (cmd) {
+	case FPGA_CFG_IOC_RESET:
+		mutex_lock(&uf->lock);
+		fpga_cfg_upload_pages_free(uf->udev, &uf->pages);
+		mutex_unlock(&uf->lock);
+		return 0;
+	case FPGA_CFG_IOC_LOAD:
+		return fpga_cfg_upload_load(uf, (void __user *)arg);
+	case FPGA_CFG_IOC_LOAD_DESC:
+		return fpga_cfg_upload_load_desc(uf, (void __user *)arg);
 	}
 
-	memset(&info, 0, sizeof(info));
-	inst->bs_lsb_first = 0;
-	inst->cfg_done = false;
-	inst->cfg_op1 = NOP_MGR;
-	inst->cfg_op2 = NOP_MGR;
+	return -ENOTTY;
+}
+
+static const struct file_operations fpga_cfg_upload_fops = {
+	.owner = THIS_MODULE,
+	.open = fpga_cfg_upload_open,
+	.release = fpga_cfg_upload_release,
+	.write_iter = fpga_cfg_upload_write_iter,
+	.splice_write = iter_file_splice_write,
+	.unlocked_ioctl = fpga_cfg_upload_ioctl,
+	.compat_ioctl = fpga_cfg_upload_ioctl,
+	.llseek = no_llseek,
+};
 
-	strncpy(inst->fpga_drv, "fpga_mfd", sizeof(inst->fpga_drv));
-	inst->fpga_drv_args[0] = 0;
+static int fpga_cfg_upload_register(struct fpga_cfg_fpga_inst *inst)
+{
+	struct fpga_cfg_upload_dev *udev;
+	int ret;
 
-	ret = fpga_cfg_desc_parse(inst, buf, size);
-	if (ret < 0)
+	udev = kzalloc(sizeof(*udev), GFP_KERNEL);
+	if (!udev)
+		return -ENOMEM;
+
+	kref_init(&udev->ref);
+	mutex_init(&udev->lock);
+	init_waitqueue_head(&udev->wq_loads);
+	udev->inst = inst;
+	snprintf(udev->name, sizeof(udev->name), "fpga_cfg-%s",
+		 inst->cfg->dir_buf);
+	snprintf(udev->nodename, sizeof(udev->nodename), "fpga_cfg/%s",
+		 inst->cfg->dir_buf);
+
+	udev->misc.minor = MISC_DYNAMIC_MINOR;
+	udev->misc.name = udev->name;
+	udev->misc.nodename = udev->nodename;
+	udev->misc.fops = &fpga_cfg_upload_fops;
+	udev->misc.parent = &inst->cfg->pdev->dev;
+	udev->misc.mode = 0600;
+
+	ret = misc_register(&udev->misc);
+	if (ret) {
+		kfree(udev);
 		return ret;
+	}
 
-	if (inst->debug)
-		dev_dbg(dev, "MGRs: %p %p %p %p\n",
-			inst->fpp.mgr, inst->spi.mgr,
-			inst->cvp.mgr, inst->pr.mgr);
+	inst->upload = udev;
+	return 0;
+}
 
-	if (!inst->history_header) {
-		fpga_cfg_history_header(inst);
-		fpga_cfg_update_hist_attr(inst);
+static void fpga_cfg_upload_unregister(struct fpga_cfg_fpga_inst *inst)
+{
+	struct fpga_cfg_upload_dev *udev = inst->upload;
+
+	if (!udev)
+		return;
+
+	misc_deregister(&udev->misc);
+
+	/* open files see inst == NULL, wait for the running loads */
+	mutex_lock(&udev->lock);
+	udev->inst = NULL;
+	mutex_unlock(&udev->lock);
+	wait_event(udev->wq_loads, !READ_ONCE(udev->loads));
+
+	inst->upload = NULL;
+	kref_put(&udev->ref, fpga_cfg_upload_dev_release);
+}
+#else
+static inline int fpga_cfg_upload_register(struct fpga_cfg_fpga_inst *inst)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline void fpga_cfg_upload_unregister(struct fpga_cfg_fpga_inst *inst)
+{
+}
+#endif
+
+static ssize_t show_async(struct fpga_cfg_fpga_inst *inst,
+			  struct attribute *attr, char *buf)
+{
+	return snprintf(buf, 3, "%d\n", inst->async);
+}
+
+static ssize_t store_async(struct fpga_cfg_fpga_inst *inst,
+			   struct attribute *attr, const char *buf, size_t size)
+{
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	inst->async = val;
+	return size;
+}
+
+static ssize_t show_load_if_changed(struct fpga_cfg_fpga_inst *inst,
+				    struct attribute *attr, char *buf)
+{
+	return snprintf(buf, 3, "%d\n", inst->load_if_changed);
+}
+
+static ssize_t store_load_if_changed(struct fpga_cfg_fpga_inst *inst,
+				     struct attribute *attr,
+				     const char *buf, size_t size)
+{
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	inst->load_if_changed = val;
+	return size;
+}
+
+static ssize_t show_progress(struct fpga_cfg_fpga_inst *inst,
+			     struct attribute *attr, char *buf)
+{
+	struct fpga_cfg_progress *cur = &inst->progress;
+	struct fpga_cfg_progress_snap p;
+	const char *state;
+	size_t done;
+	u64 ns;
+	bool est = false;
+
+	spin_lock(&cur->lock);
+	p.seq = cur->seq;
+	p.stage = cur->stage;
+	p.running = cur->running;
+	p.ret = cur->ret;
+	p.bytes_done = cur->bytes_done;
+	p.bytes_total = cur->bytes_total;
+	p.start_ns = cur->start_ns;
+	p.end_ns = cur->end_ns;
+	p.last_bps = cur->last_bps;
+	p.avg_bps = cur->avg_bps;
+	spin_unlock(&cur->lock);
+
+	if (!p.seq)
+		return scnprintf(buf, PAGE_SIZE, "seq: 0\n");
+
+	done = p.bytes_done;
+	if (p.running) {
+		state = "running";
+		ns = local_clock() - p.start_ns;
+		if (p.stage == FPGA_CFG_STAGE_WRITE && p.avg_bps) {
+			/* keep below total until the manager returns */
+			done = min_t(u64, div64_u64(p.avg_bps * div_u64(ns,
+					NSEC_PER_USEC), USEC_PER_SEC),
+				     p.bytes_total ? p.bytes_total - 1 : 0);
+			est = true;
+		}
+	} else {
+		state = p.ret < 0 ? "failed" : "done";
+		ns = p.end_ns - p.start_ns;
+	}
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "seq: %llu\nstage: %s\nstate: %s\nerror: %d\n"
+			 "bytes: %zu%s\ntotal: %zu\nelapsed_ms: %llu\n"
+			 "last_bps: %llu\navg_bps: %llu\n",
+			 p.seq, fpga_cfg_stage_str[p.stage], state, p.ret,
+			 done, est ? " (estimated)" : "", p.bytes_total,
+			 div_u64(ns, NSEC_PER_MSEC), p.last_bps, p.avg_bps);
+}
+
+/* Last job queued by the reading process, within the kept results */
+static ssize_t show_job(struct fpga_cfg_fpga_inst *inst,
+			struct attribute *attr, char *buf)
+{
+	pid_t tgid = task_tgid_nr(current);
+	struct fpga_cfg_job_result *res;
+	size_t id, found = 0;
+
+	mutex_lock(&inst->job_lock);
+	for (id = inst->job_seq_num; id && !found &&
+	     id + FPGA_CFG_JOB_RESULTS > inst->job_seq_num; id--) {
+		res = &inst->job_results[id % FPGA_CFG_JOB_RESULTS];
+		if (res->id == id && res->tgid == tgid)
+			found = id;
+	}
+	mutex_unlock(&inst->job_lock);
+
+	return snprintf(buf, 24, "%zu\n", found);
+}
+
+static ssize_t show_unbind_timeout_ms(struct fpga_cfg_fpga_inst *inst,
+				      struct attribute *attr, char *buf)
+{
+	return snprintf(buf, 12, "%u\n", inst->unbind_timeout_ms);
+}
+
+static ssize_t store_unbind_timeout_ms(struct fpga_cfg_fpga_inst *inst,
+				       struct attribute *attr,
+				       const char *buf, size_t size)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (!val || val > 60000)
+		return -EINVAL;
+
+	inst->unbind_timeout_ms = val;
+	return size;
+}
+
+static ssize_t show_linkup_timeout_ms(struct fpga_cfg_fpga_inst *inst,
+				      struct attribute *attr, char *buf)
+{
+	return snprintf(buf, 12, "%u\n", inst->linkup_timeout_ms);
+}
+
+static ssize_t store_linkup_timeout_ms(struct fpga_cfg_fpga_inst *inst,
+				       struct attribute *attr,
+				       const char *buf, size_t size)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (!val || val > 60000)
+		return -EINVAL;
+
+	inst->linkup_timeout_ms = val;
+	return size;
+}
+
+#define FPGA_CFG_LINKUP_BUF_SZ	1024
+
+static ssize_t fpga_cfg_linkup_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	char *tmp;
+	int len;
+	ssize_t ret;
+
+	tmp = kmalloc(FPGA_CFG_LINKUP_BUF_SZ, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	len = fpga_cfg_lat_print(&inst->stage_lat[FPGA_CFG_STAGE_LINKUP],
+				 "linkup", tmp,
+				 FPGA_CFG_LINKUP_BUF_SZ);
+	len += scnprintf(tmp + len, FPGA_CFG_LINKUP_BUF_SZ - len,
+			 "timeouts: %lu\nrescans: %lu\n",
+			 inst->linkup_timeouts, inst->linkup_rescans);
+
+	ret = simple_read_from_buffer(buf, count, ppos, tmp, len);
+	kfree(tmp);
+	return ret;
+}
+
+static const struct file_operations dbgfs_linkup_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_linkup_read,
+	.llseek = default_llseek,
+};
+
+#define FPGA_CFG_STATS_BUF_SZ	(FPGA_CFG_STAGES * 512 + 512)
+
+static ssize_t fpga_cfg_stats_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	char *tmp;
+	int i, len = 0;
+	ssize_t ret;
+
+	tmp = kmalloc(FPGA_CFG_STATS_BUF_SZ, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	for (i = 0; i < FPGA_CFG_STAGES; i++)
+		len += fpga_cfg_lat_print(&inst->stage_lat[i],
+					  fpga_cfg_stage_str[i], tmp + len,
+					  FPGA_CFG_STATS_BUF_SZ - len);
+	len += fpga_cfg_tput_print(&inst->fpp.tput, "fpp", tmp + len,
+				   FPGA_CFG_STATS_BUF_SZ - len);
+	len += fpga_cfg_tput_print(&inst->spi.tput, "spi", tmp + len,
+				   FPGA_CFG_STATS_BUF_SZ - len);
+	len += fpga_cfg_tput_print(&inst->cvp.tput, "cvp", tmp + len,
+				   FPGA_CFG_STATS_BUF_SZ - len);
+
+	ret = simple_read_from_buffer(buf, count, ppos, tmp, len);
+	kfree(tmp);
+	return ret;
+}
+
+static const struct file_operations dbgfs_stats_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_stats_read,
+	.llseek = default_llseek,
+};
+
+#define FPGA_CFG_PR_STATS_BUF_SZ	(FPGA_CFG_PR_REGIONS * 1024)
+
+static ssize_t fpga_cfg_pr_stats_read(struct file *file, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	struct fpga_cfg_pr_region *r;
+	char name[16];
+	char *tmp;
+	int i, len;
+	ssize_t ret;
+
+	tmp = kmalloc(FPGA_CFG_PR_STATS_BUF_SZ, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	len = 0;
+	mutex_lock(&inst->pr_regions_lock);
+	for (i = 0; i < FPGA_CFG_PR_REGIONS; i++) {
+		r = inst->pr_regions[i];
+		if (!r)
+			continue;
+		snprintf(name, sizeof(name), "region %d", i);
+		len += fpga_cfg_lat_print(&r->lat, name, tmp + len,
+					  FPGA_CFG_PR_STATS_BUF_SZ - len);
+		len += fpga_cfg_tput_print(&r->desc.tput, "  write", tmp + len,
+					   FPGA_CFG_PR_STATS_BUF_SZ - len);
+		mutex_lock(&pr_cache_lock);
+		len += scnprintf(tmp + len, FPGA_CFG_PR_STATS_BUF_SZ - len,
+				 "  seq: %zu\n  cached: %s\n  lookups: %lu\n"
+				 "  invalidations: %lu\n", r->seq_num,
+				 r->pdev ? pci_name(r->pdev) : "-",
+				 r->lookups, r->invalidations);
+		mutex_unlock(&pr_cache_lock);
+	}
+	mutex_unlock(&inst->pr_regions_lock);
+
+	ret = simple_read_from_buffer(buf, count, ppos, tmp, len);
+	kfree(tmp);
+	return ret;
+}
+
+static const struct file_operations dbgfs_pr_stats_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_pr_stats_read,
+	.llseek = default_llseek,
+};
+
+#define FPGA_CFG_PR_QUEUE_BUF_SZ	2048
+
+static ssize_t fpga_cfg_pr_queue_read(struct file *file, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	struct fpga_cfg_pr_pending *p;
+	u64 now = local_clock();
+	char *tmp;
+	int len;
+	ssize_t ret;
+
+	tmp = kmalloc(FPGA_CFG_PR_QUEUE_BUF_SZ, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	len = fpga_cfg_lat_print(&inst->pr_wait_lat, "wait", tmp,
+				 FPGA_CFG_PR_QUEUE_BUF_SZ);
+	mutex_lock(&inst->pr_queue_lock);
+	len += scnprintf(tmp + len, FPGA_CFG_PR_QUEUE_BUF_SZ - len,
+			 "depth: %u\nmax depth: %u\nqueued: %lu\n"
+			 "coalesced: %lu\n", inst->pr_queue_depth,
+			 inst->pr_queue_max, inst->pr_queued,
+			 inst->pr_coalesced);
+	list_for_each_entry(p, &inst->pr_queue, list)
+		len += scnprintf(tmp + len, FPGA_CFG_PR_QUEUE_BUF_SZ - len,
+				 "job %zu: region %u prio %u %s %llu ms\n",
+				 p->id, p->region, p->prio,
+				 p->running ? "running" : "waiting",
+				 div_u64(now - p->queued_ns, NSEC_PER_MSEC));
+	mutex_unlock(&inst->pr_queue_lock);
+
+	ret = simple_read_from_buffer(buf, count, ppos, tmp, len);
+	kfree(tmp);
+	return ret;
+}
+
+static const struct file_operations dbgfs_pr_queue_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_pr_queue_read,
+	.llseek = default_llseek,
+};
+
+#define FPGA_CFG_JOBS_BUF_SZ	(FPGA_CFG_JOB_RESULTS * 48)
+
+static ssize_t fpga_cfg_jobs_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_fpga_inst *inst = file->private_data;
+	struct fpga_cfg_job_result *res;
+	size_t first, id;
+	char *tmp;
+	int len = 0;
+	ssize_t ret;
+
+	tmp = kmalloc(FPGA_CFG_JOBS_BUF_SZ, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	mutex_lock(&inst->job_lock);
+	first = inst->job_seq_num > FPGA_CFG_JOB_RESULTS ?
+		inst->job_seq_num - FPGA_CFG_JOB_RESULTS + 1 : 1;
+	for (id = first; id <= inst->job_seq_num; id++) {
+		res = &inst->job_results[id % FPGA_CFG_JOB_RESULTS];
+		len += snprintf(tmp + len, FPGA_CFG_JOBS_BUF_SZ - len,
+				"job %zu: %s %d\n", res->id,
+				fpga_cfg_job_state_str[res->state], res->err);
+	}
+	mutex_unlock(&inst->job_lock);
+
+	ret = simple_read_from_buffer(buf, count, ppos, tmp, len);
+	kfree(tmp);
+	return ret;
+}
+
+static const struct file_operations dbgfs_jobs_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_jobs_read,
+	.llseek = default_llseek,
+};
+
+static DEFINE_MUTEX(fleet_lock);
+static char *fleet_report;
+static size_t fleet_report_len;
+
+/* Called with mgr_list_lock held */
+static struct fpga_cfg_fpga_inst *fpga_cfg_find_inst(const char *name)
+{
+	struct fpga_cfg_device *cfg;
+	struct fpga_cfg *priv;
+
+	list_for_each_entry(cfg, &mgr_devs, list) {
+		priv = platform_get_drvdata(cfg->pdev);
+		if (priv && !strcmp(priv->dir_buf, name))
+			return &priv->fpga;
 	}
+	return NULL;
+}
+
+/*
+ * Split the manifest into per-instance descriptions and parse them.
+ * The manifest contains one block per instance:
+ *
+ * fpp_single.0 {
+ *	fpp-image = "/lib/firmware/a.rbf";
+ * }
+ * fpp_single.1 <profile name>
+ *
+ * Called with mgr_list_lock held, so the instances can't go away
+ * until their jobs are queued.
+ */
+static int fpga_cfg_fleet_parse(struct fpga_cfg_fleet *fleet, char *buf)
+{
+	struct fpga_cfg_fleet_entry *entry;
+	struct fpga_cfg_fpga_inst *inst;
+	struct fpga_cfg_req *req;
+	char name[16];
+	char *p, *desc, *end;
+	size_t len;
+	int i;
 
-	if (inst->cfg_op1 == FPP_RING_MGR || inst->cfg_op1 == SPI_RING_MGR) {
+	p = buf;
+	while (*p) {
+		p = skip_spaces(p);
+		if (!*p)
+			break;
 
-		if (inst->fpp.mgr) {
-			desc = &inst->fpp;
-		} else if (inst->spi.mgr) {
-			desc = &inst->spi;
-		} else
-			return -ENODEV;
+		len = strcspn(p, " \t\n");
+		if (!len || len >= sizeof(name)) {
+			pr_err("fpga-cfg: invalid instance name in manifest\n");
+			return -EINVAL;
+		}
+		memcpy(name, p, len);
+		name[len] = 0;
+		p += len;
+		p += strspn(p, " \t");
+
+		/* description block or profile name */
+		desc = p;
+		if (*desc == '{') {
+			end = strstr(desc, "\n}\n");
+			if (end)
+				end += 3;
+		} else {
+			end = desc + strcspn(desc, "\n");
+		}
+		if (!end || end == desc) {
+			pr_err("fpga-cfg: invalid description for '%s'\n", name);
+			return -EINVAL;
+		}
+		p = end;
 
-		pdev = fpga_cfg_find_cvp_dev(inst);
-		if (pdev) {
-			if (pdev->driver) {
-				/* Unbind driver from FPGA device first */
-				list_add_tail(&inst->link, &pci_dev_wait_list);
-				pci_device_driver_unbind(&pdev->dev);
+		if (fleet->nr_entries == FPGA_CFG_FLEET_MAX) {
+			pr_err("fpga-cfg: more than %d manifest entries\n",
+			       FPGA_CFG_FLEET_MAX);
+			return -E2BIG;
+		}
 
-				ret = wait_event_timeout(inst->wq_unbind,
-							 !pdev->driver,
-							 msecs_to_jiffies(500));
-				if (!ret) {
-					dev_warn(dev, "PCI device unbind timeout\n");
-				}
+		inst = fpga_cfg_find_inst(name);
+		if (!inst) {
+			pr_err("fpga-cfg: no instance '%s'\n", name);
+			return -ENODEV;
+		}
+		for (i = 0; i < fleet->nr_entries; i++) {
+			if (fleet->entries[i].inst == inst) {
+				pr_err("fpga-cfg: '%s' listed twice\n", name);
+				return -EINVAL;
 			}
-		} else {
-			if (inst->debug)
-				dev_dbg(dev,
-					"No FPGA yet. Loading periph. image\n");
 		}
 
-		/*
-		 * There is no FPGA user anymore, now we can start loading
-		 * the periph. image implementing PCIe CvP device.
-		 */
-		inst->pci_dev = NULL;
-		inst->drv_bound = false;
-		if (inst->cfg_op2 == CVP_MGR)
-			inst->driver_to_bind = "altera-cvp";
-		else
-			inst->driver_to_bind = inst->fpga_drv;
+		req = fpga_cfg_req_get(inst, desc, end - desc);
+		if (IS_ERR(req))
+			return PTR_ERR(req);
 
-		list_add_tail(&inst->link, &pci_dev_wait_list);
+		entry = &fleet->entries[fleet->nr_entries++];
+		strncpy(entry->name, name, sizeof(entry->name));
+		entry->inst = inst;
+		entry->req = req;
+	}
 
-		if (inst->cfg_op1 == SPI_RING_MGR) {
-			if (inst->bs_lsb_first)
-				info.flags = FPGA_MGR_BITSTREAM_LSB_FIRST;
-			else
-				info.flags &= ~FPGA_MGR_BITSTREAM_LSB_FIRST;
-		}
+	return fleet->nr_entries ? 0 : -EINVAL;
+}
 
-		if (inst->debug)
-			dev_dbg(dev, "%s cfg step start\n",
-				inst_is_fpp(inst) ? "FPP" : "SPI");
+#define FPGA_CFG_FLEET_REPORT_SZ	((FPGA_CFG_FLEET_MAX + 1) * 64)
 
-		/* Load ring image now */
-#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
-		info.firmware_name = desc->firmware;
-		ret = fpga_mgr_load(desc->mgr, &info);
-#else
-		ret = fpga_mgr_firmware_load(desc->mgr, &info, desc->firmware);
-#endif
-		if (ret < 0) {
-			dev_warn(dev, "%s fpga_mgr failed: %d\n",
-				 inst_is_fpp(inst) ? "FPP" : "SPI", ret);
-			list_del_init(&inst->link);
-			goto err;
-		}
+/* Called with fleet_lock held */
+static void fpga_cfg_fleet_report(struct fpga_cfg_fleet *fleet, u64 total_ns)
+{
+	struct fpga_cfg_fleet_entry *entry;
+	int i, failed = 0;
+	size_t len = 0;
+	char *rep;
 
-		if (inst->debug) {
-			dev_dbg(dev, "%s cfg step done\n",
-				inst_is_fpp(inst) ? "FPP" : "SPI");
+	rep = kmalloc(FPGA_CFG_FLEET_REPORT_SZ, GFP_KERNEL);
+	if (!rep)
+		return;
 
-		}
+	for (i = 0; i < fleet->nr_entries; i++) {
+		entry = &fleet->entries[i];
+		if (entry->ret < 0)
+			failed++;
+		len += scnprintf(rep + len, FPGA_CFG_FLEET_REPORT_SZ - len,
+				 "%s: %d %llu ms\n", entry->name, entry->ret,
+				 div_u64(entry->duration_ns, NSEC_PER_MSEC));
+	}
+	len += scnprintf(rep + len, FPGA_CFG_FLEET_REPORT_SZ - len,
+			 "total: %llu ms, %d of %d failed\n",
+			 div_u64(total_ns, NSEC_PER_MSEC), failed,
+			 fleet->nr_entries);
+
+	kfree(fleet_report);
+	fleet_report = rep;
+	fleet_report_len = len;
+}
 
-		inst->cfg_done = true;
-		inst->cfg_seq_num += 1;
-		fpga_cfg_op_log(inst, desc);
+static ssize_t fpga_cfg_fleet_write(struct file *file, const char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	struct fpga_cfg_fleet *fleet;
+	u64 start;
+	char *buf;
+	int i, ret;
 
-		if (inst->debug)
-			dev_dbg(dev, "Waiting for PCIe device hotplug\n");
+	if (!count || count > FPGA_CFG_FLEET_MAX * SZ_16K)
+		return -EINVAL;
 
-		ret = wait_event_timeout(inst->wq_bind, inst->drv_bound,
-					 msecs_to_jiffies(1000));
-		if (ret) {
-			if (inst->debug)
-				dev_dbg(dev, "PCIe FPGA %s, driver bound: '%s'\n",
-					dev_name(&inst->pci_dev->dev),
-					inst->pci_dev->driver->name);
-		} else {
-			if (inst->debug)
-				dev_warn(dev, "PCIe device link up timeout\n");
-			ret = pci_device_driver_bind(pdev, inst,
-						     inst->driver_to_bind);
-			if (ret) {
-				dev_err(dev, "Failed to bind '%s' driver %d\n",
-					inst->driver_to_bind, ret);
-				goto err;
-			}
-		}
+	/* vmemdup_user() with room for the NUL */
+	buf = kvmalloc(count + 1, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (copy_from_user(buf, ubuf, count)) {
+		kvfree(buf);
+		return -EFAULT;
 	}
+	buf[count] = 0;
 
-	if (inst->cfg_op1 == SPI_MGR) {
-		desc = &inst->spi;
-		if (inst->debug)
-			dev_dbg(dev, "SPI cfg step start\n");
-#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
-		info.firmware_name = desc->firmware;
-		ret = fpga_mgr_load(desc->mgr, &info);
-#else
-		ret = fpga_mgr_firmware_load(desc->mgr, &info, desc->firmware);
-#endif
-		if (ret < 0) {
-			dev_warn(dev, "SPI fpga_mgr failed: %d\n", ret);
-			goto err;
-		}
-
-		inst->cfg_done = true;
-		inst->cfg_seq_num += 1;
-		fpga_cfg_op_log(inst, desc);
-		if (inst->debug)
-			dev_dbg(dev, "SPI cfg step done\n");
-		sysfs_notify(&inst->kobj_fpga_dir, NULL, "status");
-		return size;
+	fleet = vzalloc(sizeof(*fleet));
+	if (!fleet) {
+		kvfree(buf);
+		return -ENOMEM;
 	}
+	kref_init(&fleet->ref);
+	init_completion(&fleet->done);
 
-	if (inst->cfg_op1 == PR_MGR) {
-		if (inst->debug)
-			dev_dbg(dev, "PR cfg step start\n");
-		pdev = fpga_cfg_find_cvp_dev(inst);
-		if (!pdev) {
-			return -ENODEV;
-		}
+	start = local_clock();
 
-		inst->pr.mgr = fpga_mgr_get(&pdev->dev);
-		if (IS_ERR(inst->pr.mgr)) {
-			ret = PTR_ERR(inst->pr.mgr);
-			inst->pr.mgr = NULL;
-			dev_err(dev, "failed getting PR manager: %d\n", ret);
-			return ret;
-		}
-		if (inst->debug)
-			dev_dbg(dev, "Using PR manager: '%s'\n",
-				inst->pr.mgr->name);
+	mutex_lock(&mgr_list_lock);
+	ret = fpga_cfg_fleet_parse(fleet, buf);
+	if (ret < 0) {
+		mutex_unlock(&mgr_list_lock);
+		for (i = 0; i < fleet->nr_entries; i++)
+			vfree(fleet->entries[i].req);
+		goto out;
+	}
 
-		info.flags = FPGA_MGR_PARTIAL_RECONFIG;
-#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
-		info.firmware_name = inst->pr.firmware;
-		ret = fpga_mgr_load(inst->pr.mgr, &info);
-#else
-		ret = fpga_mgr_firmware_load(inst->pr.mgr, &info,
-					     inst->pr.firmware);
-#endif
+	atomic_set(&fleet->pending, fleet->nr_entries);
+	for (i = 0; i < fleet->nr_entries; i++) {
+		ret = fpga_cfg_queue_job(fleet->entries[i].inst,
+					 fleet->entries[i].req, fleet, i);
 		if (ret < 0) {
-			fpga_mgr_put(inst->pr.mgr);
-			inst->pr.mgr = NULL;
-			return ret;
-		}
-		inst->cfg_seq_num += 1;
-		fpga_cfg_op_log(inst, &inst->pr);
-		fpga_mgr_put(inst->pr.mgr);
-		inst->pr_seq_num += 1;
-		inst->pr.mgr = NULL;
-		inst->cfg_done = true;
-		if (inst->debug)
-			dev_dbg(dev, "PR cfg step done\n");
-
-		sysfs_remove_file_from_group(&inst->kobj_fpga_dir,
-					&inst->pr_image_attr.attr, "pr");
-		sysfs_remove_file_from_group(&inst->kobj_fpga_dir,
-					&inst->pr_meta_attr.attr, "pr");
-
-		snprintf(&inst->pr_image_attr_name[5],
-			 sizeof(inst->pr_image_attr_name) - 5,
-			 "%zi", inst->pr_seq_num);
-		snprintf(&inst->pr_meta_attr_name[4],
-			 sizeof(inst->pr_meta_attr_name) - 4,
-			 "%zi", inst->pr_seq_num);
-
-		ret = sysfs_add_file_to_group(&inst->kobj_fpga_dir,
-				&inst->pr_image_attr.attr, "pr");
-		ret |= sysfs_add_file_to_group(&inst->kobj_fpga_dir,
-				&inst->pr_meta_attr.attr, "pr");
-		if (ret) {
-			dev_err(&pdev->dev, "cannot add pr img file\n");
+			vfree(fleet->entries[i].req);
+			fleet->entries[i].ret = ret;
+			if (atomic_dec_and_test(&fleet->pending))
+				complete(&fleet->done);
 		}
-		sysfs_notify(&inst->kobj_fpga_dir, NULL, "ready");
-		return size;
 	}
+	mutex_unlock(&mgr_list_lock);
 
-	/* Run CvP configuration if requested */
-	if (inst->cfg_op2 == CVP_MGR) {
-		ret = fpga_cfg_do_cvp(inst);
-		if (ret < 0)
-			goto err;
-	}
+	/* the queued jobs keep running and drop the fleet when killed */
+	ret = wait_for_completion_killable(&fleet->done);
+	if (ret)
+		goto out;
 
-	sysfs_notify(&inst->kobj_fpga_dir, NULL, "status");
+	mutex_lock(&fleet_lock);
+	fpga_cfg_fleet_report(fleet, local_clock() - start);
+	mutex_unlock(&fleet_lock);
 
-	return size;
+	for (i = 0; i < fleet->nr_entries; i++) {
+		if (fleet->entries[i].ret < 0) {
+			ret = fleet->entries[i].ret;
+			break;
+		}
+	}
+out:
+	kref_put(&fleet->ref, fpga_cfg_fleet_release);
+	kvfree(buf);
+	return ret < 0 ? ret : count;
+}
 
-err:
-	return ret ? ret : size;
+static ssize_t fpga_cfg_fleet_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&fleet_lock);
+	ret = simple_read_from_buffer(buf, count, ppos, fleet_report,
+				      fleet_report_len);
+	mutex_unlock(&fleet_lock);
+	return ret;
 }
 
+static const struct file_operations dbgfs_fleet_ops = {
+	.open = simple_open,
+	.read = fpga_cfg_fleet_read,
+	.write = fpga_cfg_fleet_write,
+	.llseek = default_llseek,
+};
+
 #define FPGA_CFG_ATTR_RO(_name) \
 	struct fpga_cfg_attribute fpga_cfg_attr_##_name = \
 	__ATTR(_name, S_IRUGO, show_##_name, NULL)
@@ -1571,7 +6008,13 @@ err:
 static FPGA_CFG_ATTR_RW(debug);
 static FPGA_CFG_ATTR_RW(load);
 static FPGA_CFG_ATTR_RO(status);
+static FPGA_CFG_ATTR_RO(progress);
 static FPGA_CFG_ATTR_RO(ready);
+static FPGA_CFG_ATTR_RW(async);
+static FPGA_CFG_ATTR_RO(job);
+static FPGA_CFG_ATTR_RW(load_if_changed);
+static FPGA_CFG_ATTR_RW(unbind_timeout_ms);
+static FPGA_CFG_ATTR_RW(linkup_timeout_ms);
 
 static struct attribute *fpga_cfg_sysfs_attrs[] = {
 	/*&fpga_cfg_attr_history.attr,*/
@@ -1579,6 +6022,12 @@ static struct attribute *fpga_cfg_sysfs_attrs[] = {
 	&fpga_cfg_attr_load.attr,
 	&fpga_cfg_attr_ready.attr,
 	&fpga_cfg_attr_status.attr,
+	&fpga_cfg_attr_progress.attr,
+	&fpga_cfg_attr_async.attr,
+	&fpga_cfg_attr_job.attr,
+	&fpga_cfg_attr_load_if_changed.attr,
+	&fpga_cfg_attr_unbind_timeout_ms.attr,
+	&fpga_cfg_attr_linkup_timeout_ms.attr,
 	NULL,
 	NULL
 };
@@ -1591,6 +6040,72 @@ static struct kobj_type fpga_cfg_ktype = {
 static ssize_t show_image(struct fpga_cfg_fpga_inst *inst, struct attribute *attr, char *buf);
 static ssize_t show_meta(struct fpga_cfg_fpga_inst *inst, struct attribute *attr, char *buf);
 
+/* Attribute of the pr<N> group of PR region N */
+struct fpga_cfg_pr_attribute {
+	struct fpga_cfg_attribute attr;
+	unsigned int region;
+};
+
+static struct cfg_desc *fpga_cfg_attr_pr_desc(struct fpga_cfg_fpga_inst *inst,
+					      struct attribute *attr,
+					      size_t *seq_num)
+{
+	struct fpga_cfg_pr_attribute *pr_attr;
+	struct fpga_cfg_pr_region *r;
+
+	pr_attr = container_of(attr, struct fpga_cfg_pr_attribute, attr.attr);
+	r = inst->pr_regions[pr_attr->region];
+	if (!r)
+		return NULL;
+	if (seq_num)
+		*seq_num = r->seq_num;
+	return &r->desc;
+}
+
+static ssize_t show_pr_image(struct fpga_cfg_fpga_inst *inst,
+			     struct attribute *attr, char *buf)
+{
+	struct cfg_desc *desc = fpga_cfg_attr_pr_desc(inst, attr, NULL);
+
+	if (!desc)
+		return -ENODEV;
+	return snprintf(buf, PATH_MAX + NAME_MAX, "%s\n", desc->firmware_abs);
+}
+
+static ssize_t show_pr_meta(struct fpga_cfg_fpga_inst *inst,
+			    struct attribute *attr, char *buf)
+{
+	struct cfg_desc *desc = fpga_cfg_attr_pr_desc(inst, attr, NULL);
+
+	if (!desc)
+		return -ENODEV;
+	return snprintf(buf, PATH_MAX + NAME_MAX, "%s\n", desc->metadata_abs);
+}
+
+static ssize_t show_pr_seq(struct fpga_cfg_fpga_inst *inst,
+			   struct attribute *attr, char *buf)
+{
+	size_t seq_num;
+
+	if (!fpga_cfg_attr_pr_desc(inst, attr, &seq_num))
+		return -ENODEV;
+	return sprintf(buf, "%zu\n", seq_num);
+}
+
+/* Sequence number and image of the last PR load, notified on change */
+static ssize_t show_pr_current(struct fpga_cfg_fpga_inst *inst,
+			       struct attribute *attr, char *buf)
+{
+	struct cfg_desc *desc;
+	size_t seq_num;
+
+	desc = fpga_cfg_attr_pr_desc(inst, attr, &seq_num);
+	if (!desc)
+		return -ENODEV;
+	return snprintf(buf, PAGE_SIZE, "%zu %s\n", seq_num,
+			desc->firmware_abs);
+}
+
 #define FPGA_CFG_ATTR_FPP_RO(_name) \
 	struct fpga_cfg_attribute fpga_cfg_attr_fpp_##_name = \
 	__ATTR(_name, S_IRUGO, show_##_name, NULL)
@@ -1603,6 +6118,29 @@ static ssize_t show_meta(struct fpga_cfg_fpga_inst *inst, struct attribute *attr
 	struct fpga_cfg_attribute fpga_cfg_attr_cvp_##_name = \
 	__ATTR(_name, S_IRUGO, show_##_name, NULL)
 
+#define FPGA_CFG_ATTR_PR_RO(_name, _region) \
+	struct fpga_cfg_pr_attribute fpga_cfg_attr_pr##_region##_##_name = { \
+		.attr = __ATTR(_name, S_IRUGO, show_pr_##_name, NULL), \
+		.region = _region, \
+	}
+
+#define FPGA_CFG_PR_ATTR_GROUP(_region, _grp_name) \
+	static FPGA_CFG_ATTR_PR_RO(image, _region); \
+	static FPGA_CFG_ATTR_PR_RO(meta, _region); \
+	static FPGA_CFG_ATTR_PR_RO(seq, _region); \
+	static FPGA_CFG_ATTR_PR_RO(current, _region); \
+	static struct attribute *fpga_cfg_pr##_region##_attrs[] = { \
+		&fpga_cfg_attr_pr##_region##_image.attr.attr, \
+		&fpga_cfg_attr_pr##_region##_meta.attr.attr, \
+		&fpga_cfg_attr_pr##_region##_seq.attr.attr, \
+		&fpga_cfg_attr_pr##_region##_current.attr.attr, \
+		NULL \
+	}; \
+	static struct attribute_group fpga_cfg_pr##_region##_attribute_group = { \
+		.name	= _grp_name, \
+		.attrs	= fpga_cfg_pr##_region##_attrs \
+	}
+
 static FPGA_CFG_ATTR_FPP_RO(image);
 static FPGA_CFG_ATTR_FPP_RO(meta);
 static FPGA_CFG_ATTR_SPI_RO(image);
@@ -1643,14 +6181,24 @@ static struct attribute_group fpga_cfg_cvp_attribute_group = {
 	.attrs	= fpga_cfg_cvp_attrs
 };
 
+FPGA_CFG_PR_ATTR_GROUP(0, "pr");
+FPGA_CFG_PR_ATTR_GROUP(1, "pr1");
+FPGA_CFG_PR_ATTR_GROUP(2, "pr2");
+FPGA_CFG_PR_ATTR_GROUP(3, "pr3");
+
+static const struct attribute_group *fpga_cfg_pr_groups[FPGA_CFG_PR_REGIONS] = {
+	&fpga_cfg_pr0_attribute_group,
+	&fpga_cfg_pr1_attribute_group,
+	&fpga_cfg_pr2_attribute_group,
+	&fpga_cfg_pr3_attribute_group,
+};
+
 static ssize_t show_image(struct fpga_cfg_fpga_inst *inst,
 			  struct attribute *attr, char *buf)
 {
 	struct cfg_desc *desc;
 
-	if (attr == &inst->pr_image_attr.attr)
-		desc = &inst->pr;
-	else if (attr == fpga_cfg_fpp_attrs[0])
+	if (attr == fpga_cfg_fpp_attrs[0])
 		desc = &inst->fpp;
 	else if (attr == fpga_cfg_spi_attrs[0])
 		desc = &inst->spi;
@@ -1667,9 +6215,7 @@ static ssize_t show_meta(struct fpga_cfg_fpga_inst *inst,
 {
 	struct cfg_desc *desc;
 
-	if (attr == &inst->pr_meta_attr.attr)
-		desc = &inst->pr;
-	else if (attr == fpga_cfg_fpp_attrs[1])
+	if (attr == fpga_cfg_fpp_attrs[1])
 		desc = &inst->fpp;
 	else if (attr == fpga_cfg_spi_attrs[1])
 		desc = &inst->spi;
@@ -1692,18 +6238,26 @@ struct debugfs_entry entries[] = {
 	{ "load" },
 	{ "ready" },
 	{ "status" },
+	{ "progress" },
+	{ "async" },
+	{ "job" },
+	{ "load_if_changed" },
+	{ "unbind_timeout_ms" },
+	{ "linkup_timeout_ms" },
 	{ NULL },
 };
 
-static char target_buf[PATH_MAX];
-
 static void create_debugfs_entry(struct fpga_cfg *priv, int dev_idx, char *name)
 {
 	struct dentry *dir = priv->dbgfs_devdir;
+	char *target;
 
-	sprintf(target_buf, "/sys/devices/platform/fpga-cfg.%d/%s/%s",
-		dev_idx, priv->dir_buf, name);
-	debugfs_create_symlink(name, dir, target_buf);
+	target = kasprintf(GFP_KERNEL, "/sys/devices/platform/fpga-cfg.%d/%s/%s",
+			   dev_idx, priv->dir_buf, name);
+	if (!target)
+		return;
+	debugfs_create_symlink(name, dir, target);
+	kfree(target);
 }
 
 static void create_debugfs_entries(struct fpga_cfg *priv, int dev_idx)
@@ -1722,7 +6276,9 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 	struct fpga_manager *mgr = NULL;
 	struct fpga_cfg *priv;
 	enum fpga_cfg_mgr_type mgr_type;
-	int ret;
+	char mgr_name_buf[128];
+	char mgr_name_addr_buf[16];
+	int i, ret;
 
 	pdata = dev_get_platdata(&pdev->dev);
 	if (!pdata || !pdata->mgr) {
@@ -1761,8 +6317,8 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 	if (mgr_type == FPP_RING_MGR) {
 		priv->fpga.fpp.mgr = mgr;
 		priv->fpga.fpp.mgr_dev = mgr->dev.parent;
-		ret = sscanf(mgr->name, "%s %s %s", fpga_cfg_mgr_name_buf,
-			     fpga_cfg_mgr_name_addr_buf, priv->fpga.usb_dev_id);
+		ret = sscanf(mgr->name, "%127s %15s %15s", mgr_name_buf,
+			     mgr_name_addr_buf, priv->fpga.usb_dev_id);
 		if (ret != 3) {
 			dev_err(dev,
 				"Can't find address or usb id in mgr name: %d\n", ret);
@@ -1770,9 +6326,12 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 			goto err_mgr;
 		}
 		snprintf(priv->dir_buf, sizeof(priv->dir_buf),
-			 "fpp_%s.%d", fpga_cfg_mgr_name_addr_buf, pdev->id);
+			 "fpp_%s.%d", mgr_name_addr_buf, pdev->id);
+		/* USB bus number from "<bus>-<port>:<cfg>.<intf>" */
+		snprintf(inst->bus_group, sizeof(inst->bus_group), "usb%.*s",
+			 (int)strcspn(inst->usb_dev_id, "-"), inst->usb_dev_id);
 		dev_dbg(dev, "FPP board address: '%s'\n",
-			fpga_cfg_mgr_name_addr_buf);
+			mgr_name_addr_buf);
 		dev_dbg(dev, "FPP manager usb id: '%s'\n",
 			priv->fpga.usb_dev_id);
 	}
@@ -1780,8 +6339,8 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 	if (mgr_type == SPI_RING_MGR || mgr_type == SPI_MGR) {
 		priv->fpga.spi.mgr = mgr;
 		priv->fpga.spi.mgr_dev = mgr->dev.parent;
-		ret = sscanf(mgr->name, "%s %s", fpga_cfg_mgr_name_buf,
-			     fpga_cfg_mgr_name_addr_buf);
+		ret = sscanf(mgr->name, "%127s %15s", mgr_name_buf,
+			     mgr_name_addr_buf);
 		if (ret != 2) {
 			dev_err(dev,
 				"Can't find device id in mgr name: %d\n", ret);
@@ -1789,7 +6348,19 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 			goto err_mgr;
 		}
 		snprintf(priv->dir_buf, sizeof(priv->dir_buf),
-			 "spi_%s", fpga_cfg_mgr_name_addr_buf);
+			 "spi_%s", mgr_name_addr_buf);
+		/* SPI controller from "spi<bus>.<cs>" */
+		snprintf(inst->bus_group, sizeof(inst->bus_group), "%.*s",
+			 (int)strcspn(mgr_name_addr_buf, "."),
+			 mgr_name_addr_buf);
+	}
+
+	if (inst->bus_group[0]) {
+		inst->bus_grp = fpga_cfg_bus_group_get(inst->bus_group);
+		if (!inst->bus_grp) {
+			ret = -ENOMEM;
+			goto err_mgr;
+		}
 	}
 
 	/* Create sub-directory for fpga config interface */
@@ -1811,13 +6382,133 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 		goto err_mgr;
 	}
 
-	priv->fpga.history_max_entries = fpgacfg_hist_len;
+	if (!debugfs_create_file("history_follow", 0444, priv->dbgfs_devdir,
+				 inst, &dbgfs_history_follow_ops)) {
+		dev_err(&pdev->dev, "Can't create debugfs history_follow entry\n");
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOENT;
+		goto err_mgr;
+	}
+
+	inst->dbgfs_jobs = debugfs_create_file("jobs", 0444,
+					       priv->dbgfs_devdir, inst,
+					       &dbgfs_jobs_ops);
+	if (!inst->dbgfs_jobs) {
+		dev_err(&pdev->dev, "Can't create debugfs jobs entry\n");
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOENT;
+		goto err_mgr;
+	}
+
+	if (!debugfs_create_file("linkup", 0444, priv->dbgfs_devdir, inst,
+				 &dbgfs_linkup_ops)) {
+		dev_err(&pdev->dev, "Can't create debugfs linkup entry\n");
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOENT;
+		goto err_mgr;
+	}
+
+	if (!debugfs_create_file("stats", 0444, priv->dbgfs_devdir, inst,
+				 &dbgfs_stats_ops)) {
+		dev_err(&pdev->dev, "Can't create debugfs stats entry\n");
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOENT;
+		goto err_mgr;
+	}
+
+	if (!debugfs_create_file("pr_stats", 0444, priv->dbgfs_devdir, inst,
+				 &dbgfs_pr_stats_ops)) {
+		dev_err(&pdev->dev, "Can't create debugfs pr_stats entry\n");
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOENT;
+		goto err_mgr;
+	}
+
+	if (!debugfs_create_file("pr_queue", 0444, priv->dbgfs_devdir, inst,
+				 &dbgfs_pr_queue_ops)) {
+		dev_err(&pdev->dev, "Can't create debugfs pr_queue entry\n");
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOENT;
+		goto err_mgr;
+	}
+
+	inst->dbgfs_profiles = debugfs_create_dir("profiles",
+						  priv->dbgfs_devdir);
+	if (!inst->dbgfs_profiles ||
+	    !debugfs_create_file("register", 0200, inst->dbgfs_profiles,
+				 inst, &dbgfs_profile_register_ops) ||
+	    !debugfs_create_file("unregister", 0200, inst->dbgfs_profiles,
+				 inst, &dbgfs_profile_unregister_ops)) {
+		dev_err(&pdev->dev, "Can't create debugfs profiles entry\n");
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOENT;
+		goto err_mgr;
+	}
+
+	inst->job_wq = alloc_ordered_workqueue("fpga_cfg_%s", 0,
+					       priv->dir_buf);
+	if (!inst->job_wq) {
+		dev_err(&pdev->dev, "Can't create job queue\n");
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOMEM;
+		goto err_mgr;
+	}
+	inst->pr_wq = alloc_workqueue("fpga_cfg_%s_pr", WQ_UNBOUND,
+				      FPGA_CFG_PR_REGIONS, priv->dir_buf);
+	if (!inst->pr_wq) {
+		dev_err(&pdev->dev, "Can't create PR queue\n");
+		destroy_workqueue(inst->job_wq);
+		debugfs_remove_recursive(priv->dbgfs_devdir);
+		ret = -ENOMEM;
+		goto err_mgr;
+	}
+
+	priv->fpga.history.max_entries = fpgacfg_hist_len;
+	ret = fpga_cfg_history_alloc(inst);
+	if (ret) {
+		dev_err(&pdev->dev, "Can't allocate history\n");
+		goto err0;
+	}
+	priv->fpga.unbind_timeout_ms = FPGA_CFG_UNBIND_TIMEOUT_MS;
+	priv->fpga.linkup_timeout_ms = FPGA_CFG_LINKUP_TIMEOUT_MS;
+	for (i = 0; i < FPGA_CFG_STAGES; i++)
+		spin_lock_init(&priv->fpga.stage_lat[i].lock);
+	spin_lock_init(&priv->fpga.progress.lock);
+	INIT_DELAYED_WORK(&priv->fpga.progress_work, fpga_cfg_progress_work);
+	spin_lock_init(&priv->fpga.fpp.tput.lock);
+	spin_lock_init(&priv->fpga.spi.tput.lock);
+	spin_lock_init(&priv->fpga.cvp.tput.lock);
+	init_rwsem(&priv->fpga.pr_sem);
+	mutex_init(&priv->fpga.pr_regions_lock);
+	mutex_init(&priv->fpga.pr_queue_lock);
+	INIT_LIST_HEAD(&priv->fpga.pr_queue);
+	INIT_LIST_HEAD(&priv->fpga.pr_barriers);
+	init_waitqueue_head(&priv->fpga.pr_queue_wq);
+	priv->fpga.pr_oldest_gen = ULONG_MAX;
+	for (i = 0; i < FPGA_CFG_PR_REGIONS; i++) {
+		INIT_WORK(&priv->fpga.pr_workers[i].work, fpga_cfg_pr_work);
+		priv->fpga.pr_workers[i].inst = inst;
+		priv->fpga.pr_workers[i].region = i;
+	}
+	INIT_WORK(&priv->fpga.modprobe_work, fpga_cfg_modprobe_work);
+	spin_lock_init(&priv->fpga.pr_wait_lat.lock);
 
+	mutex_init(&priv->fpga.load_lock);
+	mutex_init(&priv->fpga.job_lock);
 	mutex_init(&priv->fpga.history_lock);
-	INIT_LIST_HEAD(&priv->fpga.history_list);
+	mutex_init(&priv->fpga.profile_lock);
+	INIT_LIST_HEAD(&priv->fpga.profiles);
 	init_waitqueue_head(&priv->fpga.wq_bind);
 	init_waitqueue_head(&priv->fpga.wq_unbind);
 	init_waitqueue_head(&priv->fpga.hist_queue);
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+	INIT_WORK(&priv->fpga.cvp.prefetch_work, fpga_cfg_prefetch_work);
+#endif
+	inst->pr_regions[0] = fpga_cfg_pr_region_alloc(inst, 0);
+	if (!inst->pr_regions[0]) {
+		ret = -ENOMEM;
+		goto err0;
+	}
 
 	ret = kobject_init_and_add(&priv->fpga.kobj_fpga_dir,
 				   &fpga_cfg_ktype, &pdev->dev.kobj,
@@ -1856,30 +6547,8 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 	}
 
 	if (priv->fpga.fpp.mgr) {
-		snprintf(priv->fpga.pr_image_attr_name,
-			 sizeof(priv->fpga.pr_image_attr_name),
-			 "image%zi", priv->fpga.pr_seq_num);
-		snprintf(priv->fpga.pr_meta_attr_name,
-			 sizeof(priv->fpga.pr_meta_attr_name),
-			 "meta%zi", priv->fpga.pr_seq_num);
-
-		priv->fpga.pr_image_attr.attr.name = inst->pr_image_attr_name;
-		priv->fpga.pr_image_attr.attr.mode = S_IRUGO;
-		priv->fpga.pr_image_attr.show = show_image;
-		sysfs_attr_init(&priv->fpga.pr_image_attr.attr);
-		priv->fpga.pr_meta_attr.attr.name = inst->pr_meta_attr_name;
-		priv->fpga.pr_meta_attr.attr.mode = S_IRUGO;
-		priv->fpga.pr_meta_attr.show = show_meta;
-		sysfs_attr_init(&priv->fpga.pr_meta_attr.attr);
-
-		priv->fpga.pr_attrs[0] = &priv->fpga.pr_image_attr.attr;
-		priv->fpga.pr_attrs[1] = &priv->fpga.pr_meta_attr.attr;
-		priv->fpga.pr_attrs[2] = NULL;
-		priv->fpga.pr_attr_grp.name = "pr";
-		priv->fpga.pr_attr_grp.attrs = priv->fpga.pr_attrs;
-
 		ret = sysfs_create_group(&priv->fpga.kobj_fpga_dir,
-					 &priv->fpga.pr_attr_grp);
+					 &fpga_cfg_pr0_attribute_group);
 		if (ret) {
 			dev_err(&pdev->dev, "Cannot add pr group\n");
 			goto err3;
@@ -1895,14 +6564,10 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 		create_debugfs_entry(priv, pdev->id, "spi");
 		if (priv->fpga.mgr_type == SPI_MGR ||
 		    priv->fpga.mgr_type == SPI_RING_MGR) {
-			create_debugfs_entry(priv, pdev->id,
-					     entries[2].name);
-			create_debugfs_entry(priv, pdev->id,
-					     entries[3].name);
-			create_debugfs_entry(priv, pdev->id,
-					     entries[4].name);
-			create_debugfs_entry(priv, pdev->id,
-					     entries[5].name);
+			/* all entries except "cvp" and "pr" */
+			for (i = 2; entries[i].name; i++)
+				create_debugfs_entry(priv, pdev->id,
+						     entries[i].name);
 		}
 		if (priv->fpga.mgr_type == SPI_RING_MGR) {
 			create_debugfs_entry(priv, pdev->id,
@@ -1910,6 +6575,10 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 		}
 	}
 
+	ret = fpga_cfg_upload_register(inst);
+	if (ret && ret != -EOPNOTSUPP)
+		dev_warn(&pdev->dev, "No upload device: %d\n", ret);
+
 	if (mgr)
 		dev_dbg(&pdev->dev, "Using FPGA manager '%s'\n", mgr->name);
 
@@ -1918,7 +6587,7 @@ static int fpga_cfg_probe(struct platform_device *pdev)
 err4:
 	if (priv->fpga.fpp.mgr)
 		sysfs_remove_group(&inst->kobj_fpga_dir,
-				   &inst->pr_attr_grp);
+				   &fpga_cfg_pr0_attribute_group);
 */
 err3:
 	if (priv->fpga.fpp.mgr ||
@@ -1936,8 +6605,14 @@ err2:
 err1:
 	kobject_put(&priv->fpga.kobj_fpga_dir);
 err0:
+	kfree(inst->pr_regions[0]);
+	vfree(inst->history.buf);
+	vfree(inst->history.lens);
+	destroy_workqueue(inst->pr_wq);
+	destroy_workqueue(inst->job_wq);
 	debugfs_remove_recursive(priv->dbgfs_devdir);
 err_mgr:
+	fpga_cfg_bus_group_put(inst->bus_grp);
 	if (mgr && (mgr_type == SPI_RING_MGR || mgr_type == SPI_MGR ||
 	    mgr_type == FPP_RING_MGR))
 		fpga_mgr_put(mgr);
@@ -1955,17 +6630,35 @@ static int fpga_cfg_remove(struct platform_device *pdev)
 
 	inst = &priv->fpga;
 
-	dev_dbg(&pdev->dev, "%s: ID %d: fpp %p, spi %p, cvp %p, pr %p\n",
+	dev_dbg(&pdev->dev, "%s: ID %d: fpp %p, spi %p, cvp %p\n",
 		 __func__, pdev->id, inst->fpp.mgr, inst->spi.mgr,
-		 inst->cvp.mgr, inst->pr.mgr);
+		 inst->cvp.mgr);
+
+	fpga_cfg_upload_unregister(inst);
+
+	/* 'load' is still writable, refuse new async loads from now on */
+	mutex_lock(&inst->pr_queue_lock);
+	inst->removing = true;
+	mutex_unlock(&inst->pr_queue_lock);
+
+	/*
+	 * Run pending jobs to completion before tearing down, jobs wait
+	 * for the PR loads queued before them, so pr_wq goes last
+	 */
+	destroy_workqueue(inst->job_wq);
+	destroy_workqueue(inst->pr_wq);
+	fpga_cfg_wait_del(inst);
+	cancel_delayed_work_sync(&inst->progress_work);
 
 	sysfs_notify(&inst->kobj_fpga_dir, NULL, "ready");
 	sysfs_notify(&inst->kobj_fpga_dir, NULL, "status");
+	/* let blocked history_follow readers return before debugfs removal */
+	inst->history_closed = true;
 	fpga_cfg_free_log(inst);
 
 	if (inst->fpp.mgr) {
 		sysfs_remove_group(&inst->kobj_fpga_dir,
-				   &inst->pr_attr_grp);
+				   &fpga_cfg_pr0_attribute_group);
 		sysfs_remove_group(&inst->kobj_fpga_dir,
 				   &fpga_cfg_fpp_attribute_group);
 		fpga_mgr_put(inst->fpp.mgr);
@@ -1975,17 +6668,20 @@ static int fpga_cfg_remove(struct platform_device *pdev)
 		fpga_mgr_put(inst->spi.mgr);
 	} else if (inst->cvp.mgr)
 		fpga_mgr_put(inst->cvp.mgr);
-	else if (inst->pr.mgr)
-		fpga_mgr_put(inst->pr.mgr);
 
 	if (priv->fpga.fpp.mgr ||
 	    (priv->fpga.spi.mgr && priv->fpga.mgr_type == SPI_RING_MGR)) {
 		sysfs_remove_group(&inst->kobj_fpga_dir,
 				   &fpga_cfg_cvp_attribute_group);
 	}
+	fpga_cfg_pr_regions_free(inst);
 
 	kobject_put(&inst->kobj_fpga_dir);
 	debugfs_remove_recursive(priv->dbgfs_devdir);
+	fpga_cfg_bus_group_put(inst->bus_grp);
+	fpga_cfg_profiles_free(inst);
+	vfree(inst->history.buf);
+	vfree(inst->history.lens);
 	return 0;
 }
 
@@ -2040,14 +6736,26 @@ static int fpga_cfg_dev_probe(struct platform_device *pdev)
 		return -ENOENT;
 	}
 
-	ret = platform_driver_register(&fpga_cfg_driver);
+	/* Fleet manifest interface for loading multiple instances */
+	debugfs_create_file("load", 0644, dbgfs_root, NULL, &dbgfs_fleet_ops);
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+	debugfs_create_file("cache", 0644, dbgfs_root, NULL, &dbgfs_cache_ops);
+#endif
+
+	ret = fpga_cfg_genl_register();
 	if (ret)
 		goto err;
 
+	ret = platform_driver_register(&fpga_cfg_driver);
+	if (ret)
+		goto err_genl;
+
 	bus_register_notifier(&pci_bus_type, &pci_bus_notifier);
 
 	fpga_mgr_register_mgr_notifier(&fpga_mgr_notifier);
 	return 0;
+err_genl:
+	genl_unregister_family(&fpga_cfg_genl_family);
 err:
 	pr_err("%s: err: %d\n", __func__, ret);
 	debugfs_remove_recursive(dbgfs_root);
@@ -2062,6 +6770,7 @@ static int fpga_cfg_dev_remove(struct platform_device *pdev)
 	fpga_cfg_detach_mgrs(fpga_mgr_class);
 
 	platform_driver_unregister(&fpga_cfg_driver);
+	genl_unregister_family(&fpga_cfg_genl_family);
 	fpga_mgr_class = NULL;
 
 	ida_destroy(&fpga_cfg_ida);
@@ -2070,6 +6779,11 @@ static int fpga_cfg_dev_remove(struct platform_device *pdev)
 		debugfs_remove_recursive(dbgfs_root);
 		dbgfs_root = NULL;
 	}
+	kfree(fleet_report);
+	fleet_report = NULL;
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 15, 9)
+	fpga_cfg_img_cache_flush();
+#endif
 	return 0;
 }
 
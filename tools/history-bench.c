@@ -0,0 +1,241 @@
+/*
+ * Read cost of the fpga-cfg configuration history against its length.
+ *
+ * Builds the history ring of fpga-cfg-history.h in user space, fills it
+ * with entries like fpga_cfg_op_log() logs them and measures reads like
+ * fpga_cfg_history_read() does them, without the header line and with
+ * memcpy() instead of copy_to_user(). For comparison the same reads are
+ * done on a list of entries walked from the start on every read, as the
+ * history was kept before the ring.
+ *
+ * tail: a 4 KiB read at the offset of the newest entry, as 'tail -f'
+ *       does after each load
+ * full: reading the whole history in 4 KiB reads
+ * add:  appending an entry to a full ring
+ *
+ * This file is released under the GPL-v2 or later.
+ *
+ * make -C tools history-bench
+ * tools/history-bench [entries ...]
+ *
+ * Example Output:
+ *
+ *   entries    bytes  tail ns  list tail ns  full us  list full us  add ns
+ *       500    43892        7          1041        1            29      21
+ *     10000   888894        7         22053       24          2951      22
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fpga-cfg-history.h"
+
+/* as in fpga-cfg.c */
+#define FPGA_CFG_HISTORY_ENTRY_BYTES	256
+#define READ_SZ				4096
+
+struct list_entry {
+	struct list_entry *next;
+	size_t len;
+	char entry[];
+};
+
+struct bench {
+	struct fpga_cfg_ring ring;
+	struct list_entry *list;
+	size_t pos;
+	char dst[READ_SZ];
+	unsigned long seq;
+	/* entry appended by op_add() */
+	char entry[FPGA_CFG_HISTORY_ENTRY_BYTES];
+	size_t entry_len;
+};
+
+static size_t format_entry(struct bench *b, char *buf, size_t size)
+{
+	unsigned long ts = 1861 + b->seq;
+	int len;
+
+	b->seq++;
+	len = snprintf(buf, size, "[%5lu.%06lu] load %lu: %s\tmeta: %s\n",
+		       ts, (b->seq * 7919) % 1000000, b->seq,
+		       "/lib/firmware/PRAX_fpp_x8.rbf",
+		       "/lib/firmware/fpp-meta.xml");
+	return min((size_t)len, size - 1);
+}
+
+/* fpga_cfg_history_read() without the header */
+static size_t ring_read(struct bench *b, size_t pos, size_t count)
+{
+	struct fpga_cfg_ring *r = &b->ring;
+	size_t n, done = 0;
+	const char *src;
+
+	if (pos >= r->bytes)
+		return 0;
+	count = min(count, r->bytes - pos);
+	while (done < count) {
+		src = fpga_cfg_ring_seg(r, pos + done, count - done, &n);
+		memcpy(b->dst + done, src, n);
+		done += n;
+	}
+	return count;
+}
+
+/* the list walk of the former fpga_cfg_history_read() */
+static size_t list_read(struct bench *b, size_t pos, size_t count)
+{
+	struct list_entry *e;
+	size_t offs = 0, done = 0, line_offs, n;
+
+	for (e = b->list; e && done < count; e = e->next) {
+		if (pos >= offs + e->len) {
+			offs += e->len;
+			continue;
+		}
+		line_offs = pos - offs;
+		n = min(count - done, e->len - line_offs);
+		memcpy(b->dst + done, e->entry + line_offs, n);
+		done += n;
+		pos += n;
+		offs += e->len;
+	}
+	return done;
+}
+
+static int bench_init(struct bench *b, size_t entries)
+{
+	char tmp[FPGA_CFG_HISTORY_ENTRY_BYTES];
+	struct list_entry *e, **tail = &b->list;
+	size_t i, len;
+
+	memset(b, 0, sizeof(*b));
+	b->ring.max_entries = entries;
+	b->ring.size = entries * FPGA_CFG_HISTORY_ENTRY_BYTES;
+	b->ring.buf = malloc(b->ring.size);
+	b->ring.lens = malloc(entries * sizeof(*b->ring.lens));
+	if (!b->ring.buf || !b->ring.lens)
+		return -1;
+
+	for (i = 0; i < entries; i++) {
+		len = format_entry(b, tmp, sizeof(tmp));
+		fpga_cfg_ring_add(&b->ring, tmp, len);
+		e = malloc(sizeof(*e) + len);
+		if (!e)
+			return -1;
+		e->next = NULL;
+		e->len = len;
+		memcpy(e->entry, tmp, len);
+		*tail = e;
+		tail = &e->next;
+	}
+	b->pos = b->ring.bytes - b->ring.lens[(b->ring.first +
+					       b->ring.entries - 1) %
+					      b->ring.max_entries];
+	b->entry_len = format_entry(b, b->entry, sizeof(b->entry));
+	return 0;
+}
+
+static void bench_free(struct bench *b)
+{
+	struct list_entry *e;
+
+	while (b->list) {
+		e = b->list;
+		b->list = e->next;
+		free(e);
+	}
+	free(b->ring.buf);
+	free(b->ring.lens);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void op_ring_tail(struct bench *b)
+{
+	ring_read(b, b->pos, READ_SZ);
+}
+
+static void op_list_tail(struct bench *b)
+{
+	list_read(b, b->pos, READ_SZ);
+}
+
+static void op_ring_full(struct bench *b)
+{
+	size_t pos = 0, n;
+
+	while ((n = ring_read(b, pos, READ_SZ)))
+		pos += n;
+}
+
+static void op_list_full(struct bench *b)
+{
+	size_t pos = 0, n;
+
+	while ((n = list_read(b, pos, READ_SZ)))
+		pos += n;
+}
+
+static void op_add(struct bench *b)
+{
+	fpga_cfg_ring_add(&b->ring, b->entry, b->entry_len);
+}
+
+/* ns per call, repeated for at least 20 ms */
+static double measure(struct bench *b, void (*op)(struct bench *b))
+{
+	unsigned long i, iter = 1;
+	double start, ns;
+
+	for (;;) {
+		start = now_ns();
+		for (i = 0; i < iter; i++)
+			op(b);
+		ns = now_ns() - start;
+		if (ns > 20e6)
+			return ns / iter;
+		iter *= 2;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t dflt[] = { 500, 1000, 2000, 5000, 10000 };
+	double tail, list_tail, full, list_full, add;
+	size_t entries, bytes;
+	struct bench b;
+	int i, n;
+
+	n = argc > 1 ? argc - 1 : (int)(sizeof(dflt) / sizeof(dflt[0]));
+
+	printf("%7s %8s %8s %13s %8s %13s %7s\n", "entries", "bytes",
+	       "tail ns", "list tail ns", "full us", "list full us", "add ns");
+	for (i = 0; i < n; i++) {
+		entries = argc > 1 ? strtoul(argv[i + 1], NULL, 0) : dflt[i];
+		if (!entries || entries > 65535 ||
+		    bench_init(&b, entries)) {
+			fprintf(stderr, "invalid length %zu\n", entries);
+			return 1;
+		}
+
+		bytes = b.ring.bytes;
+		tail = measure(&b, op_ring_tail);
+		list_tail = measure(&b, op_list_tail);
+		full = measure(&b, op_ring_full) / 1000;
+		list_full = measure(&b, op_list_full) / 1000;
+		add = measure(&b, op_add);
+
+		printf("%7zu %8zu %8.0f %13.0f %8.0f %13.0f %7.0f\n",
+		       entries, bytes, tail, list_tail, full,
+		       list_full, add);
+		bench_free(&b);
+	}
+	return 0;
+}
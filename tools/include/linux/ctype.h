@@ -0,0 +1,15 @@
+/* User space stand-in for <linux/ctype.h>, see tools/Makefile */
+#ifndef _TOOLS_LINUX_CTYPE_H
+#define _TOOLS_LINUX_CTYPE_H
+
+#include <ctype.h>
+
+/* the kernel isspace() takes any char, libc needs unsigned char */
+static inline int tools_isspace(unsigned char c)
+{
+	return isspace(c);
+}
+#undef isspace
+#define isspace(c)	tools_isspace(c)
+
+#endif
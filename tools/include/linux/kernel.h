@@ -0,0 +1,7 @@
+/* User space stand-in for <linux/kernel.h>, see tools/Makefile */
+#ifndef _TOOLS_LINUX_KERNEL_H
+#define _TOOLS_LINUX_KERNEL_H
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+
+#endif
@@ -0,0 +1,8 @@
+/* User space stand-in for <linux/limits.h>, see tools/Makefile */
+#ifndef _LINUX_LIMITS_H
+#define _LINUX_LIMITS_H
+
+#define NAME_MAX	255
+#define PATH_MAX	4096
+
+#endif
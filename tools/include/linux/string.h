@@ -0,0 +1,7 @@
+/* User space stand-in for <linux/string.h>, see tools/Makefile */
+#ifndef _TOOLS_LINUX_STRING_H
+#define _TOOLS_LINUX_STRING_H
+
+#include <string.h>
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * Parse cost of fpga-cfg configuration descriptions.
+ *
+ * Builds the description tokenizer and key lookup of fpga-cfg-parse.h
+ * in user space and splits a description into lines, tokens and values
+ * like fpga_cfg_desc_parse() does, without storing the values in a
+ * request. Checks the reported error positions of some malformed lines
+ * before measuring.
+ *
+ * This file is released under the GPL-v2 or later.
+ *
+ * make -C tools parse-bench
+ * tools/parse-bench [-n iterations] [description file]
+ *
+ * Example Output:
+ *
+ *   description: 386 bytes, 10 lines, 10 keys
+ *   iterations: 1000000
+ *   parse: 355.8 ns/description, 35.6 ns/line, 1084.9 MB/s
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fpga-cfg-parse.h"
+
+#define BIT(n)		(1U << (n))
+/* limit of fpga_cfg_req_create() */
+#define DESC_MAX	(16 * 1024)
+
+static const char default_desc[] =
+	"{\n"
+	"\tfpga-type = \"Arria-10\";\n"
+	"\tfpga-pcie-bus-nr = \"06:00.0\";\n"
+	"\tfpp-image = \"/lib/firmware/PRAX_fpp_x8.rbf\";\n"
+	"\tfpp-image-meta = \"/lib/firmware/fpp-meta.xml\";\n"
+	"\tcvp-image = \"/lib/firmware/PRAX_cvp.rbf\";\n"
+	"\tcvp-image-meta = \"/lib/firmware/cvp-meta.xml\";\n"
+	"\tmfd-driver = \"fpga_mfd\";\n"
+	"\tmfd-driver-param = \"msi=1\";\n"
+	"\tpart-reconf-image = \"/lib/firmware/impl_a.pr_region.rbf\";\n"
+	"\tpart-reconf-region = \"0\";\n"
+	"}\n";
+
+/* malformed lines and the column reported for them */
+static const struct {
+	const char *line;
+	size_t col;
+} bad_lines[] = {
+	{ "\t= \"x\";", 2 },
+	{ "\tfpp-image \"x\";", 12 },
+	{ "\tfpp-image = x;", 14 },
+	{ "\tfpp-image = \"x;", 17 },
+	{ "\tfpp-image = \"x\"", 17 },
+	{ "\tfpp-image = \"x\" ;", 17 },
+};
+
+static char val[VAL_SZ + 1];
+
+/* Loop of fpga_cfg_desc_parse(), the found keys are returned in keys */
+static int parse(const char *buf, size_t size, unsigned int *lines,
+		 u32 *keys)
+{
+	const char *line, *eol, *last, *err;
+	enum fpga_cfg_mgr_type type;
+	struct fpga_cfg_tok tok;
+	const char *msg;
+
+	*lines = 0;
+	*keys = 0;
+	last = buf + size - 3;
+	for (line = buf + 2; line <= last; line = eol + 1) {
+		(*lines)++;
+		eol = memchr(line, '\n', last + 1 - line);
+
+		err = fpga_cfg_parse_line(line, eol, &tok, &msg);
+		if (err) {
+			fprintf(stderr, "parse error, line %u col %zu: %s\n",
+				*lines + 1, (size_t)(err - line) + 1, msg);
+			return -EINVAL;
+		}
+
+		type = fpga_cfg_key_lookup(tok.key, tok.key_len);
+		if (type == NOP_MGR || (*keys & BIT(type)))
+			continue;
+
+		*keys |= BIT(type);
+		memcpy(val, tok.val, tok.val_len);
+		val[tok.val_len] = '\0';
+	}
+	return 0;
+}
+
+static int check_errors(void)
+{
+	struct fpga_cfg_tok tok;
+	const char *line, *err, *msg;
+	size_t i, col;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(bad_lines) / sizeof(bad_lines[0]); i++) {
+		line = bad_lines[i].line;
+		err = fpga_cfg_parse_line(line, line + strlen(line), &tok,
+					  &msg);
+		col = err ? (size_t)(err - line) + 1 : 0;
+		if (col != bad_lines[i].col) {
+			fprintf(stderr, "'%s': col %zu, expected %zu\n",
+				line, col, bad_lines[i].col);
+			ret = -EINVAL;
+		}
+	}
+	return ret;
+}
+
+static char *read_desc(const char *name, size_t *size)
+{
+	char *buf = NULL;
+	size_t n = 0;
+	FILE *f;
+
+	f = fopen(name, "r");
+	if (!f) {
+		perror(name);
+		return NULL;
+	}
+	buf = malloc(DESC_MAX);
+	if (buf)
+		n = fread(buf, 1, DESC_MAX, f);
+	fclose(f);
+	*size = n;
+	return buf;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	const char *desc = default_desc;
+	size_t size = sizeof(default_desc) - 1;
+	unsigned long i, iter = 1000000;
+	unsigned int lines, nkeys;
+	double start, ns;
+	u32 keys;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iter = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-n iterations] [description]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		desc = read_desc(argv[optind], &size);
+		if (!desc)
+			return 1;
+	}
+
+	/* same framing check as fpga_cfg_req_create() */
+	if (size < 4 || strncmp(desc, "{\n", 2) ||
+	    strncmp(desc + size - 3, "\n}\n", 3)) {
+		fprintf(stderr, "description must start with '{\\n' and end with '\\n}\\n'\n");
+		return 1;
+	}
+
+	if (check_errors())
+		return 1;
+	if (parse(desc, size, &lines, &keys))
+		return 1;
+	nkeys = __builtin_popcount(keys);
+	printf("description: %zu bytes, %u lines, %u keys\n", size, lines,
+	       nkeys);
+	printf("iterations: %lu\n", iter);
+	if (!iter)
+		return 0;
+
+	start = now_ns();
+	for (i = 0; i < iter; i++)
+		parse(desc, size, &lines, &keys);
+	ns = (now_ns() - start) / iter;
+
+	printf("parse: %.1f ns/description, %.1f ns/line, %.1f MB/s\n",
+	       ns, ns / lines, size * 1e3 / ns);
+	return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * Mock FPGA managers for stress testing the fpga-cfg driver.
+ *
+ * Registers nr_mgrs FPGA managers named like Xilinx slave serial
+ * managers, so fpga-cfg creates one configuration interface per
+ * manager (spi_mock<N>.0). A write sleeps for the time the image
+ * would take at bytes_per_sec and doesn't touch any hardware, loads
+ * of different managers only share the fpga-cfg code paths.
+ *
+ * Copyright (C) 2017 DENX Software Engineering
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/sizes.h>
+#include <linux/version.h>
+#include <linux/fpga/fpga-mgr.h>
+
+#define MOCK_DRV_NAME		"fpga-cfg-mock"
+#define MOCK_MGRS_MAX		16
+
+/*
+ * Name matched by fpga-cfg, see SPI_XLNX_MGR_NAME. Up to v4.11 the name
+ * contains spaces and fpga-cfg can't parse the address behind it.
+ */
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(4, 11, 0)
+#error "fpga-cfg-mock needs a kernel newer than v4.11"
+#endif
+#define MOCK_MGR_NAME		"xlnx-slave-spi"
+
+static unsigned int nr_mgrs = 4;
+module_param(nr_mgrs, uint, 0);
+MODULE_PARM_DESC(nr_mgrs, "Number of mock FPGA managers (1 - 16)");
+
+static unsigned long bytes_per_sec = SZ_32M;
+module_param(bytes_per_sec, ulong, 0644);
+MODULE_PARM_DESC(bytes_per_sec,
+		 "Simulated write throughput (0 - writes return at once)");
+
+struct mock_mgr {
+	char name[48];
+	struct fpga_manager *mgr;
+	u64 bytes;
+};
+
+static struct platform_device *mock_pdevs[MOCK_MGRS_MAX];
+
+static enum fpga_mgr_states mock_state(struct fpga_manager *mgr)
+{
+	return FPGA_MGR_STATE_UNKNOWN;
+}
+
+static int mock_write_init(struct fpga_manager *mgr,
+			   struct fpga_image_info *info,
+			   const char *buf, size_t count)
+{
+	struct mock_mgr *m = mgr->priv;
+
+	m->bytes = 0;
+	return 0;
+}
+
+static int mock_write(struct fpga_manager *mgr, const char *buf,
+		      size_t count)
+{
+	struct mock_mgr *m = mgr->priv;
+	unsigned long bps = READ_ONCE(bytes_per_sec);
+	u64 us;
+
+	m->bytes += count;
+	if (!bps)
+		return 0;
+
+	us = div64_u64((u64)count * USEC_PER_SEC, bps);
+	if (us)
+		usleep_range(us, us + us / 16 + 1);
+	return 0;
+}
+
+static int mock_write_complete(struct fpga_manager *mgr,
+			       struct fpga_image_info *info)
+{
+	struct mock_mgr *m = mgr->priv;
+
+	dev_dbg(&mgr->dev, "%s: %llu bytes\n", __func__, m->bytes);
+	return 0;
+}
+
+static const struct fpga_manager_ops mock_ops = {
+	.state = mock_state,
+	.write_init = mock_write_init,
+	.write = mock_write,
+	.write_complete = mock_write_complete,
+};
+
+static int mock_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct mock_mgr *m;
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 17, 0)
+	struct fpga_manager *mgr;
+#endif
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 17, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+	int ret;
+#endif
+
+	m = devm_kzalloc(dev, sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	/* "<name> <address>", the address names the fpga-cfg interface */
+	snprintf(m->name, sizeof(m->name), "%s mock%d.0", MOCK_MGR_NAME,
+		 pdev->id);
+	platform_set_drvdata(pdev, m);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	mgr = devm_fpga_mgr_register(dev, m->name, &mock_ops, m);
+	if (IS_ERR(mgr))
+		return PTR_ERR(mgr);
+	m->mgr = mgr;
+	return 0;
+#elif LINUX_VERSION_CODE > KERNEL_VERSION(4, 17, 0)
+	mgr = fpga_mgr_create(dev, m->name, &mock_ops, m);
+	if (!mgr)
+		return -ENOMEM;
+
+	ret = fpga_mgr_register(mgr);
+	if (ret) {
+		fpga_mgr_free(mgr);
+		return ret;
+	}
+	m->mgr = mgr;
+	return 0;
+#else
+	return fpga_mgr_register(dev, m->name, &mock_ops, m);
+#endif
+}
+
+static int mock_remove(struct platform_device *pdev)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 17, 0)
+	struct mock_mgr *m = platform_get_drvdata(pdev);
+
+	fpga_mgr_unregister(m->mgr);
+#else
+	fpga_mgr_unregister(&pdev->dev);
+#endif
+#endif
+	return 0;
+}
+
+static struct platform_driver mock_driver = {
+	.probe = mock_probe,
+	.remove = mock_remove,
+	.driver = {
+		.name = MOCK_DRV_NAME,
+	},
+};
+
+static void mock_devs_unregister(void)
+{
+	int i;
+
+	for (i = 0; i < MOCK_MGRS_MAX; i++) {
+		if (mock_pdevs[i])
+			platform_device_unregister(mock_pdevs[i]);
+		mock_pdevs[i] = NULL;
+	}
+}
+
+static int __init mock_init(void)
+{
+	struct platform_device *pdev;
+	int i, ret;
+
+	if (!nr_mgrs || nr_mgrs > MOCK_MGRS_MAX)
+		return -EINVAL;
+
+	ret = platform_driver_register(&mock_driver);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr_mgrs; i++) {
+		pdev = platform_device_register_simple(MOCK_DRV_NAME, i,
+						       NULL, 0);
+		if (IS_ERR(pdev)) {
+			ret = PTR_ERR(pdev);
+			pr_err("%s: can't register device %d: %d\n",
+			       MOCK_DRV_NAME, i, ret);
+			goto err;
+		}
+		mock_pdevs[i] = pdev;
+	}
+	return 0;
+
+err:
+	mock_devs_unregister();
+	platform_driver_unregister(&mock_driver);
+	return ret;
+}
+
+static void __exit mock_exit(void)
+{
+	mock_devs_unregister();
+	platform_driver_unregister(&mock_driver);
+}
+
+module_init(mock_init);
+module_exit(mock_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Mock FPGA managers for fpga-cfg stress tests");
@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# Parallel load stress test of fpga-cfg with mock FPGA managers.
+#
+# Loads the fpga-cfg-mock module with max_inst managers and runs the
+# same number of loads on 1, 2, 4, ... max_inst interfaces at once.
+# Each mock write sleeps for the time the image takes at the simulated
+# throughput, so without shared locks in fpga-cfg the load rate grows
+# linearly with the number of interfaces (scaling 1.00).
+#
+# Usage: fpga-cfg-stress.sh [-n max_inst] [-l loads] [-s image_kib]
+#                           [-b bytes_per_sec]
+#
+# Needs root, a loaded fpga-cfg module and fpga-cfg-mock.ko built in
+# this directory (make KERNELDIR=...).
+
+max_inst=8
+loads=20
+size_kib=1024
+bps=33554432
+
+while getopts "n:l:s:b:" opt; do
+	case $opt in
+	n) max_inst=$OPTARG ;;
+	l) loads=$OPTARG ;;
+	s) size_kib=$OPTARG ;;
+	b) bps=$OPTARG ;;
+	*) sed -n 's/^# Usage: /Usage: /p;/^#  /p' "$0"; exit 1 ;;
+	esac
+done
+
+dir=$(cd "$(dirname "$0")" && pwd)
+cfg=/sys/kernel/debug/fpga_cfg
+image=fpga-cfg-mock.rbf
+desc=$(mktemp)
+
+cleanup() {
+	rm -f "$desc" "/lib/firmware/$image"
+	rmmod fpga-cfg-mock 2>/dev/null
+}
+trap cleanup EXIT
+
+if [ ! -d $cfg ]; then
+	echo "fpga-cfg not loaded" >&2
+	exit 1
+fi
+
+insmod "$dir/fpga-cfg-mock.ko" nr_mgrs="$max_inst" bytes_per_sec="$bps" ||
+	exit 1
+
+i=0
+while [ $i -lt "$max_inst" ]; do
+	t=0
+	while [ ! -e $cfg/spi_mock$i.0/load ]; do
+		t=$((t + 1))
+		if [ $t -gt 50 ]; then
+			echo "no interface spi_mock$i.0" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+	echo 0 > $cfg/spi_mock$i.0/async
+	i=$((i + 1))
+done
+
+dd if=/dev/urandom of="/lib/firmware/$image" bs=1k count="$size_kib" \
+	2>/dev/null
+printf '{\n\tspi-image = "/lib/firmware/%s";\n}\n' $image > "$desc"
+
+# warm up the image cache, the first load reads the file
+cat "$desc" > $cfg/spi_mock0.0/load || exit 1
+
+# load loop of one interface, prints the number of failed loads
+run() {
+	fail=0
+	n=0
+	while [ $n -lt "$loads" ]; do
+		cat "$desc" > $cfg/spi_mock$1.0/load 2>/dev/null ||
+			fail=$((fail + 1))
+		n=$((n + 1))
+	done
+	echo $fail
+}
+
+echo "image $size_kib KiB at $bps bytes/s, $loads loads per interface"
+printf "%9s %7s %9s %9s %8s %6s\n" \
+	interfaces loads time_ms loads/s scaling failed
+rate1=
+n=1
+while [ $n -le "$max_inst" ]; do
+	out=$(mktemp)
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt $n ]; do
+		run $i >> "$out" &
+		i=$((i + 1))
+	done
+	wait
+	end=$(date +%s%N)
+	failed=$(awk '{ s += $1 } END { print s + 0 }' "$out")
+	rm -f "$out"
+
+	ms=$(( (end - start) / 1000000 ))
+	total=$((n * loads))
+	rate=$(awk -v t=$total -v ms=$ms 'BEGIN { printf "%.2f", t * 1000 / ms }')
+	[ -z "$rate1" ] && rate1=$rate
+	scaling=$(awk -v r=$rate -v r1=$rate1 -v n=$n \
+		'BEGIN { printf "%.2f", r / (n * r1) }')
+	printf "%9d %7d %9d %9s %8s %6d\n" $n $total $ms $rate $scaling \
+		$failed
+
+	if [ $n -lt "$max_inst" ] && [ $((n * 2)) -gt "$max_inst" ]; then
+		n=$max_inst
+	else
+		n=$((n * 2))
+	fi
+done